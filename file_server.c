@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -6,6 +7,17 @@
 #include <pthread.h>
 #include <time.h>
 #include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <stdint.h>
 
 /**
  * file_server.c
@@ -19,6 +31,23 @@
  */
 int log_to_console = 0;
 int skip_sleep = 0;
+int run_inline = 0;
+int shard_count = 0;
+int placement = 0;
+int print_stats = 0;
+int pool_size = 0;
+int pool_max = 0;
+int queue_policy = 0;
+int limit_reject = 0;
+int memory_mode = 0;
+char *archive_dir = NULL;
+int checkpoint_every = 0;
+int durability = 0;
+size_t writeback_limit = 0;
+size_t rotate_size = 0;
+long rotate_age = 0;
+int rotate_keep = 0;
+int response_index = 0;
 
 /**
  * ANSI color codes for colored output.
@@ -38,6 +67,13 @@ int skip_sleep = 0;
 #define EMPTY_FILE      "empty.txt"
 #define COMMANDS_FILE   "commands.txt"
 
+/**
+ * Paths to the crash recovery checkpoint, and to the directory holding the
+ * undo images of files changed since (see -k).
+ */
+#define CHECKPOINT_FILE "checkpoint"
+#define UNDO_DIR        "checkpoint.d"
+
 /**
  * Constants to denote request types, for convenience.
  * See worker_thread().
@@ -48,47 +84,769 @@ int skip_sleep = 0;
 #define REQUEST_EMPTY   3
 
 /**
- * Buffer size (in bytes) for reading from files.
+ * Constants to denote thread placement policies, for convenience.
+ * See place_thread().
  */
-#define READ_BUF_SIZE   1024
+#define PLACEMENT_NONE  0
+#define PLACEMENT_CORE  1
+#define PLACEMENT_NODE  2
 
 /**
- * We can't return values from threads, but we *can* pass a pointer to
- * a preallocated return value variable to them. Thus we make use of a
- * struct for bundling thread arguments and return values into a neat
- * little package.
+ * Constants to denote dispatch queue policies, for convenience.
+ * See dispatch_pop().
+ */
+#define POLICY_FIFO     0
+#define POLICY_FAIR     1
+#define POLICY_READ     2
+#define POLICY_EDF      3
+
+/**
+ * Estimated cost of each request type, in seconds of lock time when
+ * the spec-mandated sleeps are on. Used as the service time of a request
+ * when queuing fairly across clients. See dispatch_push().
+ */
+#define COST_READ       2.0
+#define COST_WRITE      2.0
+#define COST_EMPTY      10.5
+
+/**
+ * Worker pool autoscaling parameters (see -W and scaler_thread()).
+ * The pool grows while requests wait longer than SCALE_TARGET_MS in the
+ * dispatch queue, and shrinks by one idle worker after SCALE_CALM_TICKS
+ * consecutive checks with requests waiting less than a quarter of that.
+ */
+#define SCALE_INTERVAL_MS   20
+#define SCALE_TARGET_MS     10
+#define SCALE_CALM_TICKS    25
+
+/**
+ * Number of hash buckets in the open file registry.
+ * See find_file().
+ */
+#define REGISTRY_BUCKETS    4096
+
+/**
+ * Memory-budgeted mode parameters (see -m).
+ * Requests are run by a few executor threads with EXEC_STACK_SIZE-byte stacks.
+ */
+#define EXEC_STACK_SIZE     (128 * 1024)
+
+/**
+ * Phases of a request in memory-budgeted mode. See executor_thread().
+ */
+#define PHASE_START     0
+#define PHASE_RUN       1
+#define PHASE_RELEASE   2
+#define PHASE_ACQUIRE   3
+
+/**
+ * Durability levels (see -d). With DURABILITY_CLOSE, each request syncs the files it
+ * changed before it completes; with DURABILITY_GROUP, it hands them to the sync thread,
+ * which syncs all files handed to it within GROUP_COMMIT_US microseconds at once.
+ * See commit_request().
+ */
+#define DURABILITY_NONE     0
+#define DURABILITY_CLOSE    1
+#define DURABILITY_GROUP    2
+#define GROUP_COMMIT_US     1000
+#define DIRTIED_MAX         4
+
+/**
+ * Write-back buffering (see -f). Appends to a user file collect in its buffer of up to
+ * WRITEBACK_FILE_MAX bytes, which is written out once it has been dirty for
+ * WRITEBACK_INTERVAL_US microseconds. See writeback_append().
+ */
+#define WRITEBACK_FILE_MAX      4096
+#define WRITEBACK_INTERVAL_US   50000
+
+/**
+ * Number of hash buckets for per-path rate limiters.
+ * See path_bucket().
+ */
+#define PATH_BUCKETS    1024
+
+/**
+ * Log-structured store parameters (see -b log). Segments live in LOG_DIR and are
+ * sealed once they grow past LOG_SEGMENT_SIZE bytes. The compactor checks sealed
+ * segments every LOG_COMPACT_MS milliseconds, and rewrites those that are at least
+ * half dead. Records start with LOG_MAGIC, to detect torn writes on recovery.
+ * The on-disk index has LOG_SLOT_SIZE-byte slots, starting with LOG_INDEX_SLOTS,
+ * and a checkpoint is written once LOG_CHECKPOINT_PATHS entries have changed.
+ * Each path has room for LOG_EXTENTS records in the index.
+ */
+#define LOG_DIR                 "store"
+#define LOG_SEGMENT_SIZE        (4 * 1024 * 1024)
+#define LOG_COMPACT_MS          100
+#define LOG_BUCKETS             16384
+#define LOG_MAGIC               0x4c4f4731
+#define LOG_INDEX_MAGIC         0x4c494458
+#define LOG_INDEX_SLOTS         4096
+#define LOG_SLOT_SIZE           256
+#define LOG_CHECKPOINT_PATHS    16384
+#define LOG_EXTENTS             8
+#define LOG_PATH_MAX            112
+
+/**
+ * Record types of the log-structured store. An append record adds its data
+ * to the end of the file; a reset record replaces the whole file with its data.
+ * A reset record without data is a tombstone, left by an empty. A remove record
+ * deletes the file; its index slot is kept, marked LOG_REMOVED, so probing still works.
+ */
+#define LOG_APPEND      0
+#define LOG_RESET       1
+#define LOG_REMOVE      2
+#define LOG_REMOVED     2
+
+/**
+ * I/O staging buffers: the pool holds POOL_BUFFERS buffers of POOL_BUF_SIZE bytes,
+ * in a region aligned to POOL_ALIGN so that it can be backed by huge pages.
+ * Files are read in chunks of POOL_BUF_SIZE. See buffer_lease().
+ */
+#define POOL_BUF_SIZE   (256 * 1024)
+#define POOL_BUFFERS    64
+#define POOL_ALIGN      (2 * 1024 * 1024)
+
+/**
+ * Size (in bytes) from which an empty drops the copied contents from the page cache.
+ * See read_file().
+ */
+#define DROP_BEHIND_MIN (1024 * 1024)
+
+/**
+ * Number of numbered names an archived file tries when its segment name is taken,
+ * before it is copied into <EMPTY_FILE> instead. See archive_file().
+ */
+#define ARCHIVE_ATTEMPTS 100
+
+/**
+ * Size (in bytes) from which read_file() maps a regular source file instead of
+ * reading it, and the size of the chunks it writes out of the mapping.
+ * See mmap_copy().
+ */
+#define MMAP_READ_MIN   (4 * 1024 * 1024)
+#define MMAP_CHUNK      (1024 * 1024)
+
+/**
+ * Size (in bytes) from which read_file() copies a regular source file with O_DIRECT,
+ * bypassing the page cache, and the alignment O_DIRECT transfers are made in.
+ * See direct_copy().
+ */
+#define DIRECT_IO_MIN   (64 * 1024 * 1024)
+#define DIRECT_ALIGN    4096
+
+/**
+ * Number of hash buckets in the in-memory storage engine.
+ * See memory_find().
+ */
+#define MEMORY_BUCKETS  65536
+
+/**
+ * Maximum number of threads reading the files of a multi-file read in parallel.
+ * See read_files().
+ */
+#define READ_FANOUT     8
+
+/**
+ * Size (in bytes) from which read_file() may copy a regular source file in chunks of
+ * PARALLEL_CHUNK bytes on up to READ_FANOUT threads, if CPUs are to spare. Files of
+ * DIRECT_IO_MIN bytes or more are only copied in parallel if direct I/O fails.
+ * See parallel_copy().
+ */
+#define PARALLEL_COPY_MIN   (32 * 1024 * 1024)
+#define PARALLEL_CHUNK      (8 * 1024 * 1024)
+
+/**
+ * Preallocation of files that grow by appends: space is reserved past the end of a file
+ * in extents that start at PREALLOC_MIN bytes and double up to PREALLOC_MAX bytes.
+ * The server's own files are always preallocated, and user files once they get
+ * PREALLOC_HOT appends within a second. See preallocate().
+ */
+#define PREALLOC_MIN    (1024 * 1024)
+#define PREALLOC_MAX    (64 * 1024 * 1024)
+#define PREALLOC_HOT    16
+
+/**
+ * Maximum number of sealed segments listed in the manifest of an output file.
+ * Older ones are dropped from the list, though not deleted unless pruning is on.
+ * See output_rotate().
+ */
+#define SEGMENTS_MAX    4096
+
+/**
+ * Number of requests that can be in flight to a single shard.
+ * See shard_thread().
+ */
+#define SHARD_RING_SIZE 1024
+
+/**
+ * Token bucket for rate limiting. The bucket refills at a configured rate
+ * (tokens per second) up to a configured burst, and each request takes one token.
+ * A rate of 0 disables the limit. See bucket_wait() and bucket_take().
+ * deferred counts the requests deferred on a bucket (see limiter_thread()), and held
+ * is the last scan of the limiter in which one of them had to stay deferred.
  */
 typedef struct {
-    char cmdline[109];
-    int return_value;
-} thread_parcel;
+    double rate, burst;
+} rate_limit;
+typedef struct {
+    double tokens;
+    struct timespec last;
+    int deferred;
+    unsigned long held;
+} token_bucket;
+rate_limit client_limit = {0, 0}, path_limit = {0, 0};
+
+/**
+ * Per-path token buckets, in a hash table owned by the master thread,
+ * and shared with the limiter thread under limit_lock.
+ */
+typedef struct path_limiter_struct path_limiter;
+struct path_limiter_struct {
+    char *path;
+    token_bucket bucket;
+    path_limiter *next;
+};
+path_limiter *path_limiters[PATH_BUCKETS];
+
+/**
+ * Clients are identified by an optional "@name" (or "@name:weight") prefix
+ * on the command line, and share the dispatcher in proportion to their weight.
+ * See parse_client() and dispatch_push().
+ */
+typedef struct client_t_struct client_t;
+struct client_t_struct {
+    char name[109];
+    double weight, finish;
+    token_bucket bucket;
+    client_t *next;
+};
 
 /**
  * Implementation of a FIFO locking system for the server.
  * Threads can request a ticket, and the server will assign them the next
  * available ticket number. If another ticket is being served currently,
  * the thread will be blocked until the current ticket is finished.
- * See ticket_lock() and ticket_unlock().
+ * Tickets given up before being served are kept in abandoned, and skipped
+ * once their turn comes. See ticket_lock(), ticket_abandon() and ticket_unlock().
  */
 typedef struct {
     pthread_cond_t queue;
     pthread_mutex_t lock;
     unsigned int curr, waiting;
+    unsigned int *abandoned;
+    int abandoned_count;
 } queue_lock;
 
+/**
+ * We can't return values from threads, but we *can* pass a pointer to
+ * a preallocated return value variable to them. Thus we make use of a
+ * struct for bundling thread arguments and return values into a neat
+ * little package.
+ * The parsed arguments point into args, a tokenized copy of cmdline.
+ * Requests waiting in the dispatch queue are linked through next, and
+ * reserve their place in the file's queue (lock, ticket) when dispatched.
+ * A request with a deadline (tv_sec != 0) times out if it cannot get
+ * a lock on its file by then.
+ * Requests are numbered in the order they were received (seq), and can be
+ * cancelled by that number until they hold their file's lock. Cancellable
+ * requests are kept in a list of in-flight requests. See cancel_request().
+ * A read of several files or of a glob pattern lists its files in sources,
+ * sorted by path; it locks all of them instead of path. See parse_sources().
+ * With crash recovery (-k), a request is journaled from the time it is written to
+ * <COMMANDS_FILE>, at journal_offset, until it is applied. See journal_request().
+ * A single-file request's registry node is looked up once, into file, when it is
+ * handled (see handle_request()), or when it is parked in memory-budgeted mode.
+ * In shard mode, a multi-file read handed to several shards meets them at barrier.
+ * See shard_fanout().
+ */
+typedef struct thread_parcel_struct thread_parcel;
+struct thread_parcel_struct {
+    char cmdline[109];
+    int return_value;
+    char args[109];
+    char *cmd, *path, *text;
+    int request_type;
+    client_t *client;
+    double finish;
+    queue_lock *lock;
+    unsigned int ticket;
+    struct timespec deadline;
+    unsigned long seq;
+    struct timespec queued_at;
+    int cancelled, running, tracked;
+    thread_parcel *next, *inflight_prev, *inflight_next;
+    struct file_t_struct *file;
+    struct shard_barrier_struct *barrier;
+    int phase;
+    struct timespec wake;
+    char **sources;
+    int source_count, sources_held;
+    off_t journal_offset;
+    int journaled;
+    thread_parcel *journal_prev, *journal_next;
+};
+
+/**
+ * The files of a multi-file read are read in parallel into records,
+ * one per file, by up to READ_FANOUT threads taking the next file from next.
+ * See read_files().
+ */
+typedef struct {
+    thread_parcel *parcel;
+    char **records;
+    size_t *lengths;
+    int next;
+} read_batch;
+
+/**
+ * A large file is copied in parallel in chunks, by threads taking the next chunk
+ * from next, into a region of the destination starting at dest_base.
+ * copied_to is lowered to the end of the source if it turns out to be shorter.
+ * See parallel_copy().
+ */
+typedef struct {
+    int src_fd, dest_fd;
+    off_t dest_base;
+    size_t size, copied_to;
+    int next, chunk_count, failed;
+} copy_job;
+
+/**
+ * With segment rotation (-o), each of the server's own files is a series of numbered
+ * segments: the active segment, at the file's usual path, and sealed ones at
+ * <path>.<number>, listed in the manifest at <path>.segments with the range of
+ * request numbers and the size of each. active is the number of the active segment,
+ * holding requests first_seq to last_seq (0 while it is empty) since opened.
+ * The fields of <READ_FILE> and <EMPTY_FILE> are guarded by their file's lock,
+ * and those of <COMMANDS_FILE> by the master thread (journal_lock with -k).
+ * See output_rotate().
+ */
+typedef struct {
+    unsigned long number, first_seq, last_seq;
+    size_t size;
+} segment_t;
+typedef struct {
+    char *path;
+    unsigned long active, first_seq, last_seq;
+    time_t opened;
+    segment_t *sealed;
+    int sealed_count;
+    int index_fd;
+} output_log;
+
+/**
+ * With a response index (-x), <READ_FILE> and <EMPTY_FILE> each have an index file
+ * at <path>.idx, holding an index_entry for request n at offset n * sizeof(index_entry).
+ * The entry points at the request's record: the segment it is in (see -o), and its offset
+ * and length there. Slots of requests without a record are holes, and read as zeros.
+ * See output_appended() and lookup_response().
+ */
+typedef struct {
+    uint64_t seq;
+    uint64_t segment;
+    uint64_t offset;
+    uint64_t length;
+} index_entry;
+
 /**
  * To avoid race conditions with file accesses,
- * we keep track of open files in a linked list of path-lock objects.
+ * we keep track of open files in a hash table of path-lock objects,
+ * chained through next. See find_file().
+ * In memory-budgeted mode (-m), requests waiting for a file do not hold a
+ * thread; they are parked in the file's parked list instead, and busy is set
+ * while a request holds the file. Both are guarded by lock->lock.
+ * With crash recovery (-k), applied_seq is the last request applied to the file, and
+ * undo_gen the checkpoint generation in which its undo image was last saved.
+ * applied_seq is set by the request holding the file, or under open_files_lock by a
+ * multi-file read, before the request is done applying, so checkpoints, which wait for
+ * that, see it settled. undo_gen is guarded by open_files_lock.
+ * With write-back buffering (-f), text appended to the file but not written out yet
+ * is kept in wb_data, dirty since wb_since; files with such text are chained through
+ * wb_next on the flusher's list while wb_listed is set. The buffer is guarded by
+ * wb_lock, and the list by writeback_lock.
+ * Space is reserved past the end of files that grow by appends, up to pa_end, in
+ * extents of pa_extent bytes; pa_base is where the last extent was reserved from, so
+ * a file that ends before it has been truncated since. pa_count counts the appends
+ * to a user file during second pa_window. All are only touched by the file's writer.
  */
 typedef struct file_t_struct file_t;
 struct file_t_struct {
     char *path;
     file_t *next;
     queue_lock *lock;
+    int home_node;
+    int busy;
+    thread_parcel *parked_head, *parked_tail;
+    unsigned long applied_seq, undo_gen;
+    pthread_mutex_t wb_lock;
+    char *wb_data;
+    size_t wb_len;
+    struct timespec wb_since;
+    file_t *wb_next;
+    int wb_listed;
+    off_t pa_base, pa_end, pa_extent;
+    time_t pa_window;
+    int pa_count;
 };
-file_t *open_files = NULL;
+file_t *open_files[REGISTRY_BUCKETS];
 queue_lock *open_files_lock = NULL;
 
+/**
+ * The node of the file of the request being handled on this thread, so that its
+ * appends need not look it up again. In shard mode, user files are kept out of the
+ * registry, in a table of the shard that owns them (see shard_file()). The server's
+ * own files keep their preallocation state in server_prealloc. See preallocate().
+ */
+__thread file_t *request_file = NULL;
+file_t server_prealloc[3];
+
+/**
+ * With the log-structured store (-b log), user files are kept as chains of records
+ * in append-only segment files instead of one file per path. The index maps each path
+ * to the extents of its live records, in order; the file's contents are the data of
+ * those records, concatenated. A segment's live count is the number of bytes of its
+ * records that are still referenced by the index. Appends and compaction take log_lock
+ * for writing, and reads for reading. See log_append() and log_compact().
+ *
+ * The index is a hash table of fixed-size slots in a memory-mapped file (LOG_DIR/index),
+ * probed linearly, so it is usable right after startup without being loaded. It is only
+ * written at checkpoints: entries changed since the last checkpoint are kept in the dirty
+ * table, and the index header records the log position (segment, offset) up to which the
+ * index is complete. Recovery replays only the records after that position.
+ * See log_checkpoint() and log_recover().
+ */
+typedef struct {
+    unsigned int magic, data_len;
+    unsigned short path_len;
+    unsigned char type, unused;
+} log_header;
+typedef struct {
+    int segment;
+    unsigned int offset, length, data_len;
+} log_extent;
+#define LOG_DATA(extent) ((off_t)(extent)->offset + (extent)->length - (extent)->data_len)
+typedef struct {
+    char path[LOG_PATH_MAX];
+    int used, extent_count;
+    log_extent extents[LOG_EXTENTS];
+    char padding[LOG_SLOT_SIZE - LOG_PATH_MAX - 2 * sizeof(int) - LOG_EXTENTS * sizeof(log_extent)];
+} log_entry;
+typedef struct {
+    unsigned int magic, unused;
+    unsigned long slot_count, used_count;
+    int checkpoint_segment;
+    off_t checkpoint_offset;
+} log_index_header;
+typedef struct log_dirty_struct log_dirty;
+struct log_dirty_struct {
+    log_entry entry;
+    log_dirty *next;
+};
+typedef struct {
+    int fd, unsynced;
+    off_t size, live;
+} log_segment;
+log_index_header *log_index = NULL;
+log_entry *log_slots = NULL;
+size_t log_index_size = 0;
+log_dirty *log_dirty_table[LOG_BUCKETS];
+int log_dirty_count = 0;
+log_segment *log_segments = NULL;
+int log_segment_count = 0, log_active = -1, log_closed = 0;
+pthread_rwlock_t log_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t log_compact_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_compact_ready = PTHREAD_COND_INITIALIZER;
+pthread_t log_compact_thread;
+
+/**
+ * With the in-memory engine (-b memory), user files are kept in a hash table
+ * of growable buffers, and never reach the disk. Appends take memory_lock for
+ * writing, and reads for reading. See memory_find().
+ */
+typedef struct memory_file_struct memory_file;
+struct memory_file_struct {
+    char *path, *data;
+    size_t length, capacity;
+    memory_file *next;
+};
+memory_file *memory_files[MEMORY_BUCKETS];
+pthread_rwlock_t memory_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * A storage engine holds the contents of user files (see -b), behind the same
+ * operations on whole files by path. Callers hold the file's lock, so engines only
+ * guard their own structures. glob adds the paths matching a pattern to a list of
+ * strings allocated with malloc(), or the pattern itself if none match. sync makes
+ * a file's contents durable, and advise passes a posix_fadvise() hint on for the whole
+ * file's data; both may be NULL for engines that keep nothing on disk.
+ * The server's own files always use posix_engine. See engine_for().
+ */
+typedef struct {
+    char *name;
+    int (*open)();
+    void (*close)();
+    int (*append)(char *path, char *data, size_t length);
+    char *(*read_all)(char *path, size_t *length);
+    ssize_t (*read_range)(char *path, char *buf, size_t length, off_t offset);
+    int (*truncate)(char *path);
+    int (*remove)(char *path);
+    int (*exists)(char *path);
+    int (*stat)(char *path, size_t *size);
+    void (*glob)(char *pattern, glob_t *matches);
+    int (*sync)(char *path);
+    void (*advise)(char *path, int advice);
+} storage_engine;
+storage_engine *storage = NULL;
+
+/**
+ * In shard mode (-s), each shard thread owns a disjoint set of file paths
+ * (by hash) and runs their requests to completion in FIFO order.
+ * The master thread hands requests over through a single-producer,
+ * single-consumer ring per shard. The ring slots themselves are not locked;
+ * the two semaphores count free and filled slots, and order the accesses.
+ * See shard_push(), shard_pop() and shard_thread().
+ */
+typedef struct {
+    pthread_t thread;
+    int id;
+    sem_t slots, items;
+    unsigned int head, tail;
+    void *ring[SHARD_RING_SIZE];
+    struct file_t_struct *files[REGISTRY_BUCKETS];
+} shard_t;
+shard_t *shards = NULL;
+
+/**
+ * A multi-file read of files owned by several shards is handed to each of them,
+ * and runs on the last one to take it off its ring, while the others wait for it.
+ * Since the rings are FIFO, every owner has then handled the requests received before
+ * the read, and only handles those received after it once it is done. arrived counts
+ * the shards that took it off their ring, and refs those still using the barrier.
+ * See shard_fanout() and shard_gather().
+ */
+typedef struct shard_barrier_struct shard_barrier;
+struct shard_barrier_struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int arrived, needed, finished, refs;
+};
+
+/**
+ * With -l delay, requests over a rate limit wait in the deferred list, in the order
+ * they were received, instead of holding up the master thread. The limiter thread
+ * starts them once their buckets refill. A request received while an earlier one for
+ * its client or file is deferred is deferred too, so that it does not overtake it.
+ * limit_lock guards the list and the token buckets, and is held by the master and
+ * limiter threads while they start a request. See admit_request() and limiter_thread().
+ * Reactor mode and -j handle one request at a time anyway, so they delay on the master
+ * thread instead (defer_limited is not set).
+ */
+pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t limit_ready = PTHREAD_COND_INITIALIZER;
+thread_parcel *deferred_head = NULL, *deferred_tail = NULL;
+int defer_limited = 0, limit_closed = 0;
+
+/**
+ * With a worker pool (-w), the master thread places requests in a dispatch queue
+ * instead of spawning a thread for each, and pool threads take them off the queue
+ * in the order chosen by the queue policy (-q). See dispatch_push() and dispatch_pop().
+ * The pool threads are detached; pool_live counts them, and pool_idle those
+ * waiting for a request. pool_retire asks that many idle threads to exit.
+ * pool_working counts threads holding their file's lock, and pool_sleeping those
+ * of them in a spec-mandated sleep. See scaler_thread().
+ */
+pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dispatch_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_exited = PTHREAD_COND_INITIALIZER;
+thread_parcel *dispatch_head = NULL, *dispatch_tail = NULL;
+client_t *clients = NULL;
+double virtual_time = 0, queue_wait_avg = 0;
+int dispatch_closed = 0, dispatch_length = 0;
+int pool_running = 0, pool_live = 0, pool_idle = 0, pool_retire = 0;
+int pool_sleeping = 0, pool_working = 0;
+
+/**
+ * Number of helper threads currently copying chunks of large files. See parallel_copy().
+ */
+int copy_helpers = 0;
+
+/**
+ * In memory-budgeted mode (-m), requests hold no thread while they wait. Requests
+ * holding their file wait out the spec-mandated sleeps in timer_heap, a binary min-heap
+ * ordered by wake time and served by timer_thread(). Requests with work to do wait in
+ * the ready queue, served by a few executor threads. evented_inflight counts requests
+ * received but not yet cleaned up. See park_request() and executor_thread().
+ */
+pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t timer_ready;
+thread_parcel **timer_heap = NULL;
+int timer_count = 0, timer_size = 0;
+pthread_mutex_t evented_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t evented_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t evented_done = PTHREAD_COND_INITIALIZER;
+thread_parcel *ready_head = NULL, *ready_tail = NULL;
+int evented_inflight = 0, evented_closed = 0;
+
+/**
+ * In memory-budgeted mode, executor threads must not block in the spec-mandated sleeps.
+ * Instead, spec_sleep() adds the sleep to deferred_us while defer_sleeps is set,
+ * and the executor has the timer thread wake the request up afterwards.
+ */
+__thread int defer_sleeps = 0;
+__thread unsigned long deferred_us = 0;
+
+/**
+ * While mmap_copy() touches a mapped source, mmap_jump points at where to resume
+ * if the source is truncated under it and the access raises SIGBUS (see mmap_fault()).
+ */
+__thread sigjmp_buf *mmap_jump = NULL;
+
+/**
+ * With a durability level (-d), a request lists the files it changes in dirtied,
+ * and syncs them once done. In group commit mode, the files to sync in the next batch
+ * are collected in sync_paths; requests wait until sync_done reaches the number of
+ * their batch (sync_batch at the time). sync_active counts the requests that changed
+ * files but have not joined a batch yet. See commit_request() and sync_thread().
+ */
+__thread char *dirtied[DIRTIED_MAX];
+__thread int dirtied_count = 0;
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sync_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t sync_finished = PTHREAD_COND_INITIALIZER;
+char **sync_paths = NULL;
+int sync_count = 0, sync_size = 0, sync_waiting = 0, sync_active = 0, sync_closed = 0;
+unsigned long sync_batch = 1, sync_done = 0;
+
+/**
+ * Write-back buffering (-f): writeback_dirty is the number of bytes buffered
+ * across all files, and writeback_head the flusher's list. See writeback_thread().
+ */
+pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writeback_ready = PTHREAD_COND_INITIALIZER;
+file_t *writeback_head = NULL;
+size_t writeback_dirty = 0;
+int writeback_closed = 0;
+
+/**
+ * Requests that have been received but not yet cleaned up, in no particular order.
+ * See cancel_request().
+ */
+pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+thread_parcel *inflight = NULL;
+
+/**
+ * With crash recovery (-k), <COMMANDS_FILE> doubles as a journal: request n is its
+ * nth line, written before the request is dispatched. Requests are journaled from
+ * then until they are applied, i.e. have made their changes to user files and to
+ * <READ_FILE> or <EMPTY_FILE>, and are listed in order of seq meanwhile (journal_head).
+ * Requests hold apply_lock for reading while they are applied, and checkpoints hold
+ * it for writing, so that a checkpoint sees every request either applied or not.
+ * Before a file is first changed after a checkpoint, its contents are saved to an undo
+ * image in UNDO_DIR, so recovery can restore the file as of the checkpoint.
+ * Requests turned away with a status instead (see report_status()) are listed in
+ * UNDO_DIR as well, so recovery reports the status again instead of redoing them.
+ * See write_checkpoint() and recover_journal().
+ */
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t undo_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpoint_ready = PTHREAD_COND_INITIALIZER;
+pthread_rwlock_t apply_lock = PTHREAD_RWLOCK_INITIALIZER;
+thread_parcel *journal_head = NULL, *journal_tail = NULL;
+unsigned long journal_seq = 0, checkpoint_gen = 0, applied_count = 0;
+off_t journal_size = 0;
+int undo_count = 0, checkpoint_due = 0, checkpoint_closed = 0;
+__thread int applying = 0;
+
+/**
+ * Segments of the server's own files (see -o and output_log), and the number of the
+ * request the current thread is appending records to them for.
+ */
+output_log outputs[] = {{READ_FILE}, {EMPTY_FILE}, {COMMANDS_FILE}};
+__thread unsigned long output_seq = 0;
+
+/**
+ * CPU topology of the host, read from sysfs at startup.
+ * cpu_ids lists the online CPUs, and cpu_node maps a CPU to its NUMA node.
+ * node_count is one more than the highest online node number, since node numbers
+ * may have gaps. Hosts without NUMA information are treated as a single node.
+ * See topology_init().
+ */
+#define MAX_CPUS        1024
+#define MAX_NODES       64
+int cpu_count = 0, node_count = 1;
+int cpu_ids[MAX_CPUS], cpu_node[MAX_CPUS];
+cpu_set_t node_cpus[MAX_NODES];
+
+/**
+ * Pool of I/O staging buffers, mapped on first use. pool_free is a stack of the
+ * indices of free buffers, and pool_huge is set if the region is backed by
+ * explicitly reserved huge pages (MAP_HUGETLB) rather than transparent ones.
+ * See buffer_lease().
+ */
+pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+char *pool_region = NULL;
+int pool_free[POOL_BUFFERS];
+int pool_free_count = 0, pool_huge = 0;
+
+/**
+ * Counters reported on exit (see -t and report_stats()).
+ * Updated with atomic builtins, since workers update them concurrently.
+ */
+unsigned long stat_requests = 0;
+unsigned long stat_remote_requests = 0;
+unsigned long stat_remote_registry = 0;
+unsigned long stat_timeouts = 0;
+unsigned long stat_cancelled = 0;
+unsigned long stat_limit_delayed = 0;
+unsigned long stat_limit_rejected = 0;
+double stat_limit_delay = 0;
+unsigned long stat_pool_grown = 0;
+unsigned long stat_pool_shrunk = 0;
+int stat_pool_peak = 0;
+int stat_inflight_peak = 0;
+unsigned long stat_archived = 0;
+unsigned long stat_archive_copied = 0;
+unsigned long stat_log_records = 0;
+unsigned long stat_log_compactions = 0;
+unsigned long stat_log_reclaimed = 0;
+unsigned long stat_log_checkpoints = 0;
+unsigned long stat_log_replayed = 0;
+unsigned long stat_checkpoints = 0;
+unsigned long stat_replayed = 0;
+unsigned long stat_sync_batches = 0;
+unsigned long stat_sync_files = 0;
+unsigned long stat_sync_requests = 0;
+unsigned long stat_prefetched = 0;
+unsigned long stat_dropped = 0;
+unsigned long stat_mmap_reads = 0;
+unsigned long stat_mmap_truncated = 0;
+unsigned long stat_direct_reads = 0;
+unsigned long stat_direct_fallbacks = 0;
+unsigned long stat_parallel_copies = 0;
+unsigned long stat_parallel_helpers = 0;
+unsigned long stat_prealloc_extents = 0;
+unsigned long stat_prealloc_bytes = 0;
+unsigned long stat_rotations = 0;
+unsigned long stat_pruned = 0;
+unsigned long stat_wb_appends = 0;
+unsigned long stat_wb_flushes = 0;
+size_t stat_wb_peak = 0;
+unsigned long stat_pool_leases = 0;
+unsigned long stat_pool_fallbacks = 0;
+int stat_pool_in_use_peak = 0;
+double stat_sync_latency = 0;
+double stat_sync_latency_max = 0;
+
+/**
+ * With an empty archive (-e), empties move their file into the archive directory
+ * instead of copying its contents. Segments are named after the time the server
+ * started (archive_run) and the request number. Two runs started within the same second
+ * can still pick the same name, so segments never replace an existing file; a counter
+ * is added to the name instead. See archive_file().
+ */
+long archive_run = 0;
+
 /*****************************
  *      Helper functions     *
  *****************************/
@@ -112,17 +870,125 @@ int determine_request(char *cmd) {
     return REQUEST_INVALID;
 }
 
+/**
+ * @fn unsigned long hash_path(char *path)
+ * @brief Hash a file path, for assigning it to a shard.
+ *        Uses the djb2 string hash.
+ * @param path The file path.
+ * @return The hash of the path.
+ */
+unsigned long hash_path(char *path) {
+    unsigned long hash = 5381;
+    int c;
+
+    while ((c = *path++) != '\0')
+        hash = ((hash << 5) + hash) + c;
+    return hash;
+}
+
+/**
+ * @fn int is_server_file(char *path)
+ * @brief Checks whether a path is one of the files written to by the server itself.
+ * @param path The file path.
+ * @return Non-zero if the path is <READ_FILE>, <EMPTY_FILE> or <COMMANDS_FILE>.
+ */
+int is_server_file(char *path) {
+    return strcmp(path, READ_FILE) == 0 ||
+           strcmp(path, EMPTY_FILE) == 0 ||
+           strcmp(path, COMMANDS_FILE) == 0;
+}
+
+/**
+ * @fn int current_node()
+ * @brief Determine the NUMA node the calling thread is currently running on.
+ * @return The node number.
+ */
+int current_node() {
+    int cpu = sched_getcpu();
+
+    return (cpu >= 0 && cpu < MAX_CPUS) ? cpu_node[cpu] : 0;
+}
+
 /**
  * @fn char *get_time()
  * @brief Create a string with the current timestamp.
+ *        The string is stored in a per-thread buffer, so that threads logging
+ *        at the same time do not overwrite each other's timestamps.
  * @return A string with the current time in the ctime format "Www Mmm dd hh:mm:ss yyyy"
  */
 char *get_time() {
+    static __thread char time_buf[26];
     time_t rawtime = time(0);
-    char *time_str = strtok(ctime(&rawtime), "\n");
+    char *time_str = ctime_r(&rawtime, time_buf);
+    time_str[strcspn(time_str, "\n")] = '\0';
     return time_str;
 }
 
+/**
+ * @fn int deadline_passed(struct timespec *deadline)
+ * @brief Checks whether a CLOCK_REALTIME deadline has passed.
+ * @param deadline The deadline.
+ * @return Non-zero if the deadline has passed.
+ */
+int deadline_passed(struct timespec *deadline) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/**
+ * @fn int deadline_before(struct timespec *a, struct timespec *b)
+ * @brief Checks whether deadline a comes before deadline b.
+ *        A missing deadline (tv_sec == 0) comes after any other.
+ * @param a The first deadline.
+ * @param b The second deadline.
+ * @return Non-zero if a comes before b.
+ */
+int deadline_before(struct timespec *a, struct timespec *b) {
+    if (a->tv_sec == 0)
+        return 0;
+    if (b->tv_sec == 0)
+        return 1;
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * @fn double elapsed_since(struct timespec *since)
+ * @brief Measure the time elapsed since a CLOCK_MONOTONIC timestamp.
+ * @param since The timestamp.
+ * @return The elapsed time in seconds.
+ */
+double elapsed_since(struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/**
+ * @fn void spec_sleep(unsigned long wait_us)
+ * @brief Sleep for one of the periods mandated by the project specification,
+ *        counting the calling thread as sleeping for the worker pool's scaler.
+ *        Executor threads in memory-budgeted mode defer the sleep instead.
+ * @param wait_us The sleep period, in microseconds.
+ */
+void spec_sleep(unsigned long wait_us) {
+    if (defer_sleeps) {
+        deferred_us += wait_us;
+        return;
+    }
+
+    __sync_fetch_and_add(&pool_sleeping, 1);
+    while (wait_us >= 1000000) {
+        sleep(1);
+        wait_us -= 1000000;
+    }
+    usleep(wait_us);
+    __sync_fetch_and_sub(&pool_sleeping, 1);
+}
+
 /**
  * @fn void print_log(int is_error, char *caller, char *msg, ...)
  * @brief Print a timestamped message to stdout.
@@ -138,7 +1004,7 @@ char *get_time() {
  * @param ... The arguments to the format string.
  */
 void print_log(int is_error, char *caller, char *msg, ...) {
-    char *time_str = get_time();
+    char *time_str;
     ssize_t msg_len;
     va_list args;
     unsigned long thread_handle = (unsigned long)pthread_self();
@@ -146,7 +1012,8 @@ void print_log(int is_error, char *caller, char *msg, ...) {
     // Don't do anything if logging is not enabled
     if (log_to_console == 0)
         return;
-    
+    time_str = get_time();
+
     // Print the timestamp, log type, and caller name
     if (is_error)
         fprintf(stderr, ANSI_YELLOW "[%s] " ANSI_RED "[ERR|%lu] " ANSI_CYAN "%s: " ANSI_RESET, time_str, thread_handle, caller);
@@ -179,79 +1046,324 @@ void ticket_init(queue_lock *lock) {
     pthread_mutex_init(&lock->lock, NULL);
     lock->curr = 0;
     lock->waiting = 0;
+    lock->abandoned = NULL;
+    lock->abandoned_count = 0;
 }
 
 /**
- * @fn void ticket_lock(char *name, queue_lock *lock)
- * @brief Place the calling function into a FIFO queue of waiting threads,
- *        managed by the given queue_lock (condition variable and mutex).
- *        Adapted from https://stackoverflow.com/a/3050871/3350320.
- * @param name The name of the object being locked (for logging only).
- * @param lock The queue_lock to use.
+ * @fn void ticket_destroy(queue_lock *lock)
+ * @brief Destroy a ticket queue lock initialized with ticket_init().
+ * @param lock The queue_lock to destroy.
  */
-void ticket_lock(char *name, queue_lock *lock) {
-    unsigned int ticket;
-
-    pthread_mutex_lock(&lock->lock);
-    ticket = lock->waiting++;
-    while (ticket != lock->curr) {
-        print_log(0, "ticket_lock", "Now waiting for ticket %d to \"%s\" (currently %d)", ticket, name, lock->curr);
-        pthread_cond_wait(&lock->queue, &lock->lock);
-    }
-    pthread_mutex_unlock(&lock->lock);
+void ticket_destroy(queue_lock *lock) {
+    pthread_mutex_destroy(&lock->lock);
+    pthread_cond_destroy(&lock->queue);
+    free(lock->abandoned);
 }
 
 /**
- * @fn void ticket_unlock(queue_lock *lock)
- * @brief Increments the current ticket in the queue lock and wakes up the thread
- *        holding the new ticket value.
- *        Adapted from https://stackoverflow.com/a/3050871/3350320.
+ * @fn void ticket_advance(queue_lock *lock)
+ * @brief Serve the next ticket, skipping any that have been abandoned.
+ *        The caller must hold lock->lock.
  * @param lock The queue_lock to use.
  */
-void ticket_unlock(queue_lock *lock) {
-    pthread_mutex_lock(&lock->lock);
+void ticket_advance(queue_lock *lock) {
+    int i;
+
     lock->curr++;
-    print_log(0, "ticket_unlock", "Now serving next ticket: %d", lock->curr);
+    for (i = 0; i < lock->abandoned_count; i++) {
+        if (lock->abandoned[i] == lock->curr) {
+            lock->abandoned[i] = lock->abandoned[--lock->abandoned_count];
+            lock->curr++;
+            i = -1;
+        }
+    }
     pthread_cond_broadcast(&lock->queue);
-    pthread_mutex_unlock(&lock->lock);
 }
 
 /**
- * @fn void enqueue(char *file_path)
- * @brief Marks a file path as currently open, and waits for a lock on it.
- * @param file_path The path of the file to open.
+ * @fn unsigned int ticket_take(queue_lock *lock)
+ * @brief Take the next ticket from a queue_lock without waiting for it to be served.
+ *        This lets a caller reserve its place in the queue while holding another lock,
+ *        and only then release that lock and wait. See enqueue().
+ * @param lock The queue_lock to use.
+ * @return The ticket number.
  */
-void enqueue(char *file_path) {
+unsigned int ticket_take(queue_lock *lock) {
+    unsigned int ticket;
+
+    pthread_mutex_lock(&lock->lock);
+    ticket = lock->waiting++;
+    pthread_mutex_unlock(&lock->lock);
+    return ticket;
+}
+
+/**
+ * @fn void ticket_wait(char *name, queue_lock *lock, unsigned int ticket)
+ * @brief Block until the given ticket is being served.
+ * @param name The name of the object being locked (for logging only).
+ * @param lock The queue_lock to use.
+ * @param ticket A ticket obtained through ticket_take().
+ */
+void ticket_wait(char *name, queue_lock *lock, unsigned int ticket) {
+    pthread_mutex_lock(&lock->lock);
+    while (ticket != lock->curr) {
+        print_log(0, "ticket_lock", "Now waiting for ticket %d to \"%s\" (currently %d)", ticket, name, lock->curr);
+        pthread_cond_wait(&lock->queue, &lock->lock);
+    }
+    pthread_mutex_unlock(&lock->lock);
+}
+
+/**
+ * @fn void dispatch_wake(queue_lock *lock)
+ * @brief Wake the pool threads if nobody holds or waits for a file anymore,
+ *        so that queued requests for the file can be dispatched. See dispatch_pop().
+ * @param lock The queue_lock of the file.
+ */
+void dispatch_wake(queue_lock *lock) {
+    int idle;
+
+    if (!pool_running)
+        return;
+
+    pthread_mutex_lock(&lock->lock);
+    idle = lock->curr == lock->waiting;
+    pthread_mutex_unlock(&lock->lock);
+    if (idle) {
+        pthread_mutex_lock(&dispatch_lock);
+        pthread_cond_broadcast(&dispatch_ready);
+        pthread_mutex_unlock(&dispatch_lock);
+    }
+}
+
+/**
+ * @fn void ticket_abandon(queue_lock *lock, unsigned int ticket)
+ * @brief Give up a ticket that has not been served yet. The ticket is skipped
+ *        when its turn comes, so the tickets behind it keep their order.
+ *        If the ticket is already being served, it is passed on right away.
+ * @param lock The queue_lock to use.
+ * @param ticket A ticket obtained through ticket_take().
+ */
+void ticket_abandon(queue_lock *lock, unsigned int ticket) {
+    int served;
+
+    pthread_mutex_lock(&lock->lock);
+    served = ticket == lock->curr;
+    if (served) {
+        ticket_advance(lock);
+    } else {
+        lock->abandoned = realloc(lock->abandoned, (lock->abandoned_count + 1) * sizeof(unsigned int));
+        lock->abandoned[lock->abandoned_count++] = ticket;
+    }
+    print_log(0, "ticket_abandon", "Abandoned ticket %d (currently %d)", ticket, lock->curr);
+    pthread_mutex_unlock(&lock->lock);
+    if (served)
+        dispatch_wake(lock);
+}
+
+/**
+ * @fn int ticket_timedwait(char *name, queue_lock *lock, unsigned int ticket, struct timespec *deadline, int *cancelled)
+ * @brief Block until the given ticket is being served, or until the deadline passes
+ *        or the waiter is cancelled, whichever comes first. In the latter two cases
+ *        the ticket is abandoned, see ticket_abandon().
+ *        To cancel a waiter, set *cancelled and broadcast lock->queue while holding lock->lock.
+ * @param name The name of the object being locked (for logging only).
+ * @param lock The queue_lock to use.
+ * @param ticket A ticket obtained through ticket_take().
+ * @param deadline Absolute CLOCK_REALTIME deadline, or NULL to wait indefinitely.
+ * @param cancelled Cancellation flag of the waiter, or NULL if it cannot be cancelled.
+ * @return 0 if the ticket is being served, ETIMEDOUT if the deadline passed first,
+ *         or ECANCELED if the waiter was cancelled first.
+ */
+int ticket_timedwait(char *name, queue_lock *lock, unsigned int ticket, struct timespec *deadline, int *cancelled) {
+    int status = 0;
+
+    pthread_mutex_lock(&lock->lock);
+    while (ticket != lock->curr) {
+        if (cancelled != NULL && __atomic_load_n(cancelled, __ATOMIC_SEQ_CST)) {
+            status = ECANCELED;
+            break;
+        }
+        print_log(0, "ticket_lock", "Now waiting for ticket %d to \"%s\" (currently %d)", ticket, name, lock->curr);
+        if (deadline == NULL)
+            pthread_cond_wait(&lock->queue, &lock->lock);
+        else if (pthread_cond_timedwait(&lock->queue, &lock->lock, deadline) == ETIMEDOUT && ticket != lock->curr) {
+            status = ETIMEDOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock->lock);
+
+    if (status != 0)
+        ticket_abandon(lock, ticket);
+    return status;
+}
+
+/**
+ * @fn void ticket_lock(char *name, queue_lock *lock)
+ * @brief Place the calling function into a FIFO queue of waiting threads,
+ *        managed by the given queue_lock (condition variable and mutex).
+ *        Adapted from https://stackoverflow.com/a/3050871/3350320.
+ * @param name The name of the object being locked (for logging only).
+ * @param lock The queue_lock to use.
+ */
+void ticket_lock(char *name, queue_lock *lock) {
+    ticket_wait(name, lock, ticket_take(lock));
+}
+
+/**
+ * @fn void ticket_unlock(queue_lock *lock)
+ * @brief Increments the current ticket in the queue lock and wakes up the thread
+ *        holding the new ticket value.
+ *        Adapted from https://stackoverflow.com/a/3050871/3350320.
+ * @param lock The queue_lock to use.
+ */
+void ticket_unlock(queue_lock *lock) {
+    pthread_mutex_lock(&lock->lock);
+    ticket_advance(lock);
+    print_log(0, "ticket_unlock", "Now serving next ticket: %d", lock->curr);
+    pthread_mutex_unlock(&lock->lock);
+}
+
+/**
+ * @fn int lock_elided(char *file_path)
+ * @brief Checks whether requests for a file path can skip its lock.
+ *        In reactor mode every request runs to completion on the master thread,
+ *        so there is nobody to contend with and no lock needs to be taken.
+ *        The same holds in shard mode for user files, which are only ever
+ *        touched by the shard that owns them; the server's own files are shared.
+ *        A multi-file read across shards runs while all of their owners wait for it
+ *        (see shard_fanout()).
+ * @param file_path The path of the file.
+ * @return Non-zero if no lock needs to be taken.
+ */
+int lock_elided(char *file_path) {
+    return run_inline || (shards != NULL && !is_server_file(file_path));
+}
+
+/**
+ * @fn shard_t *shard_for(char *path)
+ * @brief Determine which shard owns a file path.
+ * @param path The file path.
+ * @return The shard that should handle requests for the path.
+ */
+shard_t *shard_for(char *path) {
+    return &shards[hash_path(path) % shard_count];
+}
+
+/**
+ * @fn file_t *lookup_file(char *file_path)
+ * @brief Look up the registry node of a file path without creating it.
+ *        The caller must hold open_files_lock.
+ * @param file_path The path of the file.
+ * @return The file's registry node, or NULL if the file has not been opened before.
+ */
+file_t *lookup_file(char *file_path) {
     file_t *file;
-    unsigned long ticket;
 
-    // Get ticket for modifying open_files
-    print_log(0, "enqueue", "Received request to lock file \"%s\"", file_path);
-    ticket_lock("open_files", open_files_lock);
+    for (file = open_files[hash_path(file_path) % REGISTRY_BUCKETS]; file != NULL; file = file->next)
+        if (strcmp(file->path, file_path) == 0)
+            return file;
+    return NULL;
+}
+
+/**
+ * @fn file_t *find_file(char *file_path)
+ * @brief Look up the registry node of a file path, creating it if the file
+ *        has not been opened before. The caller must hold open_files_lock.
+ * @param file_path The path of the file.
+ * @return The file's registry node.
+ */
+file_t *find_file(char *file_path) {
+    file_t **bucket = &open_files[hash_path(file_path) % REGISTRY_BUCKETS], *file;
 
     // Check if the file is already open
-    file = open_files;
+    file = *bucket;
     while (file != NULL) {
         if (strcmp(file->path, file_path) == 0) {
             // File has already been opened, so wait for it to be closed
             print_log(0, "enqueue", "File \"%s\" has been opened before, acquiring ticket.", file_path);
-            goto acquire;
+            if (file->home_node != current_node())
+                __sync_fetch_and_add(&stat_remote_registry, 1);
+            return file;
         }
         file = file->next;
     }
 
-    // No files are currently open, so we can initialize the list
+    // File has not been opened before, so prepend a new node to its bucket.
+    // The node outlives the request, so it keeps its own copy of the path.
     print_log(0, "enqueue", "File \"%s\" has not been opened before, creating new file node.", file_path);
-    file = malloc(sizeof(file_t));
+    file = calloc(1, sizeof(file_t));
     file->lock = malloc(sizeof(queue_lock));
-    file->path = file_path;
-    file->next = NULL;
-    open_files = file;
+    file->path = strdup(file_path);
+    file->next = *bucket;
+    file->home_node = current_node();
+    *bucket = file;
     ticket_init(file->lock);
+    pthread_mutex_init(&file->wb_lock, NULL);
+    return file;
+}
+
+/**
+ * @fn file_t *shard_file(char *file_path)
+ * @brief Look up the node of a user file in the table of the shard that owns it,
+ *        creating it if the file has not been handled before. The node is not in the
+ *        registry and has no lock. Only the shard that owns the file may call this.
+ * @param file_path The path of the file.
+ * @return The file's node.
+ */
+file_t *shard_file(char *file_path) {
+    file_t **bucket = &shard_for(file_path)->files[hash_path(file_path) % REGISTRY_BUCKETS], *file;
+
+    for (file = *bucket; file != NULL; file = file->next)
+        if (strcmp(file->path, file_path) == 0)
+            return file;
+    file = calloc(1, sizeof(file_t));
+    file->path = strdup(file_path);
+    file->next = *bucket;
+    file->home_node = current_node();
+    *bucket = file;
+    return file;
+}
+
+/**
+ * @fn queue_lock *reserve(char *file_path, unsigned int *ticket)
+ * @brief Marks a file path as currently open, and takes a ticket for it
+ *        without waiting for the ticket to be served.
+ * @param file_path The path of the file to open.
+ * @param ticket Set to the ticket taken.
+ * @return The queue_lock of the file, to be waited on with ticket_wait().
+ */
+queue_lock *reserve(char *file_path, unsigned int *ticket) {
+    file_t *file;
+
+    // Get ticket for modifying open_files
+    print_log(0, "enqueue", "Received request to lock file \"%s\"", file_path);
+    ticket_lock("open_files", open_files_lock);
+    file = find_file(file_path);
 
-acquire:
-    ticket_lock(file_path, file->lock);
+    // Reserve our place in the file's queue, but only wait for it after
+    // releasing open_files, since the current holder of the file needs
+    // open_files to release it in dequeue().
+    *ticket = ticket_take(file->lock);
     ticket_unlock(open_files_lock);
+    return file->lock;
+}
+
+/**
+ * @fn void enqueue(char *file_path)
+ * @brief Marks a file path as currently open, and waits for a lock on it.
+ * @param file_path The path of the file to open.
+ */
+void enqueue(char *file_path) {
+    queue_lock *lock;
+    unsigned int ticket;
+
+    if (lock_elided(file_path))
+        return;
+
+    lock = reserve(file_path, &ticket);
+    ticket_wait(file_path, lock, ticket);
 }
 
 /**
@@ -260,325 +1372,5245 @@ acquire:
  * @param file_path The path of the file to close.
  */
 void dequeue(char *file_path) {
-    file_t *prev, *curr, *file;
-    thread_parcel *next;
+    file_t *file;
+
+    if (lock_elided(file_path))
+        return;
 
     // Get ticket for modifying open_files
     print_log(0, "dequeue", "Received request to unlock file \"%s\"", file_path);
     ticket_lock("open_files", open_files_lock);
 
-    // Check if the file is open
-    file = open_files;
-    while (file != NULL) {
-        if (strcmp(file->path, file_path) == 0) {
-            // File is open, is the queue empty?
-            print_log(0, "dequeue", "File \"%s\" is open, serving next ticket.", file_path);
-            ticket_unlock(file->lock);
-            break;
-        }
-        file = file->next;
-    }
+    // The file is open, since we hold its lock
+    file = find_file(file_path);
+    print_log(0, "dequeue", "File \"%s\" is open, serving next ticket.", file_path);
+    ticket_unlock(file->lock);
     ticket_unlock(open_files_lock);
+    dispatch_wake(file->lock);
 }
 
 /*****************************
- *      Command handlers     *
+ *       CPU placement       *
  *****************************/
 
 /**
- * @fn int write_file(char *file_path, char *text, int for_user)
- * @brief Write text to a file located at *file_path.
- *        If the file already exists, append text to it.
- *        If the file does not exist, create it and write text to it.
- *        If for_user is non-zero, we sleep for 25ms * number of characters in text.
- * 
- * @param file_path Path to the file, consisting of at most 50 characters.
- * @param text Text to write to the file.
- * @param for_user Set to a non-zero value if we are writing to a user-specified file.
- * @return 0 on success, -1 on failure.
+ * @fn void topology_init()
+ * @brief Read the online CPUs and their NUMA nodes from sysfs.
+ *        If the node information is unavailable, all CPUs are placed in node 0.
  */
-int write_file(char *file_path, char *text, int for_user) {
-    FILE *file;
-    int wait_us = 25000;
+void topology_init() {
+    cpu_set_t online;
+    char path[64];
+    FILE *cpulist, *nodelist;
+    int cpu, node, first, last, first_node, last_node;
 
-    // Open the file
-    file = fopen(file_path, "a");
-    if (file == NULL) {
-        // Could not open file. Print error.
-        print_log(1, "write_file", "Cannot open file \"%s\" for writing.", file_path);
-        return -1;
+    // Online CPUs are those we are allowed to run on
+    CPU_ZERO(&online);
+    sched_getaffinity(0, sizeof(cpu_set_t), &online);
+    for (cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        cpu_node[cpu] = 0;
+        if (CPU_ISSET(cpu, &online))
+            cpu_ids[cpu_count++] = cpu;
+    }
+    CPU_ZERO(&node_cpus[0]);
+    for (cpu = 0; cpu < cpu_count; cpu++)
+        CPU_SET(cpu_ids[cpu], &node_cpus[0]);
+
+    // The online nodes are listed as comma-separated ranges, e.g. "0,2-3", and
+    // need not be numbered contiguously. Each node lists its CPUs the same way.
+    nodelist = fopen("/sys/devices/system/node/online", "r");
+    while (nodelist != NULL && fscanf(nodelist, "%d", &first_node) == 1) {
+        last_node = first_node;
+        if (fscanf(nodelist, "-%d", &last_node) != 1)
+            last_node = first_node;
+        for (node = first_node; node <= last_node && node < MAX_NODES; node++) {
+            sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+            cpulist = fopen(path, "r");
+            if (cpulist == NULL)
+                continue;
+            CPU_ZERO(&node_cpus[node]);
+            while (fscanf(cpulist, "%d", &first) == 1) {
+                last = first;
+                if (fscanf(cpulist, "-%d", &last) != 1)
+                    last = first;
+                for (cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++) {
+                    if (CPU_ISSET(cpu, &online)) {
+                        cpu_node[cpu] = node;
+                        CPU_SET(cpu, &node_cpus[node]);
+                    }
+                }
+                if (fgetc(cpulist) != ',')
+                    break;
+            }
+            fclose(cpulist);
+            if (node + 1 > node_count)
+                node_count = node + 1;
+        }
+        if (fgetc(nodelist) != ',')
+            break;
     }
+    if (nodelist != NULL)
+        fclose(nodelist);
+    print_log(0, "topology", "Found %d CPUs on NUMA nodes 0 to %d.", cpu_count, node_count - 1);
+}
 
-    // Write the text to the file
-    fprintf(file, "%s", text);
+/**
+ * @fn int home_cpu(char *path)
+ * @brief Determine the CPU that owns a file path.
+ *        In shard mode, this is the CPU the path's shard is pinned to.
+ * @param path The file path.
+ * @return The CPU number.
+ */
+int home_cpu(char *path) {
+    unsigned long owner = hash_path(path);
 
-    // Project requirement: Wait 25ms per character written
-    if (for_user && skip_sleep == 0) {
-        wait_us *= strlen(text);
-        print_log(0, "write_file", "%d characters written to \"%s\". Sleeping for %d ms...", strlen(text), file_path, wait_us / 1000);
-        usleep(wait_us);
-    } else {
-        print_log(0, "write_file", "%d characters written to \"%s\".", strlen(text), file_path);
+    if (shards != NULL)
+        owner %= shard_count;
+    return cpu_ids[owner % cpu_count];
+}
+
+/**
+ * @fn void pin_thread(int cpu)
+ * @brief Pin the calling thread to a single CPU.
+ * @param cpu The CPU number.
+ */
+void pin_thread(int cpu) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0)
+        print_log(1, "placement", "Could not pin thread to CPU %d.", cpu);
+}
+
+/**
+ * @fn void place_thread(char *path)
+ * @brief Move the calling worker thread next to the data of a file path,
+ *        according to the placement policy chosen with -a.
+ *        Since the file's registry node and lock are allocated by the first
+ *        thread to request the file, they are then also placed on that node
+ *        by the kernel's first-touch policy.
+ * @param path The file path the worker is about to handle.
+ */
+void place_thread(char *path) {
+    int cpu = home_cpu(path);
+
+    if (placement == PLACEMENT_CORE) {
+        pin_thread(cpu);
+    } else if (placement == PLACEMENT_NODE) {
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[cpu_node[cpu]]) != 0)
+            print_log(1, "placement", "Could not pin thread to node %d.", cpu_node[cpu]);
     }
+}
 
-    // Close the file
-    fclose(file);
-    return 0;
+/**
+ * @fn void count_placement(char *path)
+ * @brief Record whether the calling thread finished a request for a file path
+ *        away from the path's home node, for the cross-node traffic report.
+ * @param path The file path the worker handled.
+ */
+void count_placement(char *path) {
+    __sync_fetch_and_add(&stat_requests, 1);
+    if (current_node() != cpu_node[home_cpu(path)])
+        __sync_fetch_and_add(&stat_remote_requests, 1);
 }
 
 /**
- * @fn int read_file(char *src_path, char *dest_path, char *cmdline, int before_empty)
- * @brief Append text from a file located at *file_path to <READ_FILE>.
- *        If the file exists, append the following to <READ_FILE>:
- *            <cmdline>: <contents>\n
- *        If the file does not exist, append the following to <READ_FILE>:
- *            <cmdline>: FILE DNE\n
- *        Or, if before_empty is non-zero, append the following to <READ_FILE>:
- *            <cmdline>: FILE ALREADY EMPTY\n
- * 
- * @param src_path Path to the source file, consisting of at most 50 characters.
- * @param dest_path Path to the destination file, consisting of at most 50 characters.
- * @param cmdline Command line used to call the function.
- * @param before_empty Set to a non-zero value if being called right before empty_file().
- * @return 0 on success, -1 on failure.
+ * @fn long peak_rss_kb()
+ * @brief Read the peak resident set size of the server from /proc.
+ * @return The peak RSS in kilobytes, or -1 if it is unavailable.
  */
-int read_file(char *src_path, char *dest_path, char *cmdline, int before_empty) {
-    FILE *src, *dest;
-    char buf[READ_BUF_SIZE];
-    size_t read_size;
-    int return_value = 0;
+long peak_rss_kb() {
+    FILE *status = fopen("/proc/self/status", "r");
+    char line[128];
+    long rss_kb = -1;
 
-    // Check that we are not reading content into the same file
-    if (strcmp(src_path, dest_path) == 0) {
-        print_log(1, "read_file", "Cannot read file \"%s\" into itself.", src_path);
+    if (status == NULL)
         return -1;
+    while (fgets(line, sizeof(line), status) != NULL)
+        if (sscanf(line, "VmHWM: %ld kB", &rss_kb) == 1)
+            break;
+    fclose(status);
+    return rss_kb;
+}
+
+/**
+ * @fn void report_stats()
+ * @brief Print the server's counters to stderr (see -t).
+ */
+void report_stats() {
+    fprintf(stderr, "requests: %lu handled, %lu away from their home node\n", stat_requests, stat_remote_requests);
+    fprintf(stderr, "registry: %lu accesses from a remote node\n", stat_remote_registry);
+    fprintf(stderr, "deadlines: %lu requests timed out\n", stat_timeouts);
+    fprintf(stderr, "cancel: %lu requests cancelled\n", stat_cancelled);
+    fprintf(stderr, "rate limits: %lu requests delayed for %.3f s in total, %lu rejected\n",
+            stat_limit_delayed, stat_limit_delay, stat_limit_rejected);
+    fprintf(stderr, "pool: %d workers at peak, grown %lu times, shrunk %lu times\n",
+            stat_pool_peak, stat_pool_grown, stat_pool_shrunk);
+    fprintf(stderr, "empty: %lu files archived, %lu copied\n",
+            stat_archived, stat_archive_copied);
+    if (strcmp(storage->name, "log") == 0)
+        fprintf(stderr, "log store: %lu records appended, %lu segments compacted, %lu bytes reclaimed, "
+                "%lu checkpoints, %lu records replayed on startup\n",
+                stat_log_records, stat_log_compactions, stat_log_reclaimed, stat_log_checkpoints, stat_log_replayed);
+    if (checkpoint_every > 0)
+        fprintf(stderr, "recovery: %lu checkpoints, %lu requests replayed on startup\n",
+                stat_checkpoints, stat_replayed);
+    if (durability != DURABILITY_NONE && stat_sync_batches > 0)
+        fprintf(stderr, "sync: %lu batches of %.1f requests and %.1f files on average, "
+                "%.3f ms average and %.3f ms max latency\n",
+                stat_sync_batches, (double)stat_sync_requests / stat_sync_batches,
+                (double)stat_sync_files / stat_sync_batches,
+                stat_sync_requests > 0 ? stat_sync_latency * 1000 / stat_sync_requests : 0, stat_sync_latency_max * 1000);
+    fprintf(stderr, "cache: %lu files prefetched, %lu bytes of empties dropped behind\n",
+            stat_prefetched, stat_dropped);
+    fprintf(stderr, "mmap: %lu reads mapped, %lu cut short by a truncation\n",
+            stat_mmap_reads, stat_mmap_truncated);
+    fprintf(stderr, "direct I/O: %lu reads copied, %lu writes fell back to buffered I/O\n",
+            stat_direct_reads, stat_direct_fallbacks);
+    fprintf(stderr, "parallel copy: %lu files copied, with %.1f helper threads on average\n",
+            stat_parallel_copies, stat_parallel_copies > 0 ? (double)stat_parallel_helpers / stat_parallel_copies : 0);
+    fprintf(stderr, "buffers: %lu leases of %d KB, %d of %d buffers in use at peak, %lu from the heap, %s pages\n",
+            stat_pool_leases, POOL_BUF_SIZE / 1024, stat_pool_in_use_peak, POOL_BUFFERS, stat_pool_fallbacks,
+            pool_region == NULL ? "no" : pool_huge ? "huge" : "transparent huge");
+    fprintf(stderr, "preallocation: %lu extents of %.1f MB on average\n",
+            stat_prealloc_extents, stat_prealloc_extents > 0 ? (double)stat_prealloc_bytes / stat_prealloc_extents / (1024 * 1024) : 0);
+    if (rotate_size > 0 || rotate_age > 0)
+        fprintf(stderr, "segments: %lu rotated, %lu pruned\n", stat_rotations, stat_pruned);
+    if (writeback_limit > 0)
+        fprintf(stderr, "write-back: %lu appends buffered, written out in %lu writes, %zu bytes dirty at peak\n",
+                stat_wb_appends, stat_wb_flushes, stat_wb_peak);
+    fprintf(stderr, "memory: %d requests in flight at peak, %ld KB peak RSS\n",
+            stat_inflight_peak, peak_rss_kb());
+}
+
+/*****************************
+ *  Log-structured store     *
+ *****************************/
+
+/**
+ * @fn log_entry *log_slot(char *path, int allocate)
+ * @brief Find the slot of a path in the on-disk index, by linear probing.
+ *        The caller must hold log_lock.
+ * @param path The file path.
+ * @param allocate Set to a non-zero value to return the free slot the path would take
+ *                 if it is not in the index yet.
+ * @return The slot, or NULL if the path is not in the index and allocate is zero.
+ */
+log_entry *log_slot(char *path, int allocate) {
+    unsigned long slot = hash_path(path) & (log_index->slot_count - 1);
+
+    while (log_slots[slot].used) {
+        if (strcmp(log_slots[slot].path, path) == 0)
+            return &log_slots[slot];
+        slot = (slot + 1) & (log_index->slot_count - 1);
     }
+    return allocate ? &log_slots[slot] : NULL;
+}
 
-    // We already hold a lock on the source file, so we need to acquire
-    // a lock on the destination file.
-    // To do this, we enqueue a dummy parcel for the destination file
-    // and wait for its corresponding lock.
-    print_log(0, "read_file", "Attempting to acquire lock on destination file \"%s\".", dest_path);
-    enqueue(dest_path);
-    print_log(0, "read_file", "Acquired lock on destination file \"%s\".", dest_path);
+/**
+ * @fn log_entry *log_find(char *path)
+ * @brief Look up the index entry of a path in the log-structured store, for reading.
+ *        Entries changed since the last checkpoint are in the dirty table; the others
+ *        are read straight from the on-disk index. The caller must hold log_lock.
+ * @param path The file path.
+ * @return The index entry, or NULL if the path is not in the store.
+ */
+log_entry *log_find(char *path) {
+    log_dirty *dirty;
+    log_entry *entry = NULL;
 
-    // Open destination now that we hold a lock on it.
-    dest = fopen(dest_path, "a");
-    if (dest == NULL) {
-        // Could not open file. Print error.
-        print_log(1, "read_file", "Cannot open file \"%s\" for appending.", dest_path);
-        return_value = -1;
-        goto cleanup;
+    for (dirty = log_dirty_table[hash_path(path) % LOG_BUCKETS]; dirty != NULL && entry == NULL; dirty = dirty->next)
+        if (strcmp(dirty->entry.path, path) == 0)
+            entry = &dirty->entry;
+    if (entry == NULL)
+        entry = log_slot(path, 0);
+    return entry != NULL && entry->used != LOG_REMOVED ? entry : NULL;
+}
+
+/**
+ * @fn log_entry *log_modify(char *path, int create)
+ * @brief Look up the index entry of a path in the log-structured store, for changing it.
+ *        The on-disk index is only written at checkpoints, so the entry is first copied
+ *        into the dirty table. The caller must hold log_lock for writing.
+ * @param path The file path.
+ * @param create Set to a non-zero value to create the entry if it does not exist,
+ *               or was removed.
+ * @return The index entry, or NULL if the path is not in the store and create is zero.
+ */
+log_entry *log_modify(char *path, int create) {
+    log_dirty **bucket = &log_dirty_table[hash_path(path) % LOG_BUCKETS], *dirty;
+    log_entry *slot;
+
+    for (dirty = *bucket; dirty != NULL; dirty = dirty->next)
+        if (strcmp(dirty->entry.path, path) == 0)
+            return create || dirty->entry.used != LOG_REMOVED ? &dirty->entry : NULL;
+
+    slot = log_slot(path, 0);
+    if ((slot == NULL || slot->used == LOG_REMOVED) && !create)
+        return NULL;
+    dirty = calloc(1, sizeof(log_dirty));
+    if (slot != NULL) {
+        dirty->entry = *slot;
+    } else {
+        strncpy(dirty->entry.path, path, LOG_PATH_MAX - 1);
+        dirty->entry.used = 1;
     }
+    dirty->next = *bucket;
+    *bucket = dirty;
+    log_dirty_count++;
+    return &dirty->entry;
+}
 
-    // Check if file exists
-    if (access(src_path, F_OK) != 0) {
-        // File does not exist. Print FILE DNE to READ_FILE.
-        if (before_empty == 0)
-            fprintf(dest, "%s: FILE DNE\n", cmdline);
-        else
-            fprintf(dest, "%s: FILE ALREADY EMPTY\n", cmdline);
-        print_log(1, "read_file", "File \"%s\" does not exist.", src_path);
-        return_value = -1;
-        fclose(dest);
-        goto cleanup;
+/**
+ * @fn void log_link(log_entry *entry, int type, log_extent *extent)
+ * @brief Apply a record to the index entry of its path, and to the live counts
+ *        of the segments involved. The caller must hold log_lock for writing.
+ * @param entry The index entry of the record's path, from log_modify().
+ * @param type LOG_APPEND, LOG_RESET or LOG_REMOVE.
+ * @param extent Where the record is stored.
+ */
+void log_link(log_entry *entry, int type, log_extent *extent) {
+    int index;
+
+    // A reset or remove record makes every earlier record of the path dead,
+    // and a remove record is dead itself
+    if (type != LOG_APPEND || entry->used == LOG_REMOVED) {
+        for (index = 0; index < entry->extent_count; index++)
+            if (entry->extents[index].segment < log_segment_count)
+                log_segments[entry->extents[index].segment].live -= entry->extents[index].length;
+        entry->extent_count = 0;
     }
+    entry->used = type == LOG_REMOVE ? LOG_REMOVED : 1;
+    if (type == LOG_REMOVE)
+        return;
+
+    // log_write() never lets a path outgrow its slot
+    if (entry->extent_count == LOG_EXTENTS) {
+        print_log(1, "log_store", "Too many records for \"%s\", dropping one.", entry->path);
+        return;
+    }
+    entry->extents[entry->extent_count++] = *extent;
+    log_segments[extent->segment].live += extent->length;
+}
+
+/**
+ * @fn int log_open_segment(int segment)
+ * @brief Open a segment of the log-structured store, creating it if needed,
+ *        and make room for it in log_segments. The caller must hold log_lock
+ *        for writing, unless the store is not running yet.
+ * @param segment The segment number.
+ * @return 0 on success, -1 on failure.
+ */
+int log_open_segment(int segment) {
+    struct stat segment_stat;
+    char segment_path[64];
+    int fd;
+
+    sprintf(segment_path, "%s/%08d.seg", LOG_DIR, segment);
+    fd = open(segment_path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        print_log(1, "log_store", "Cannot open segment \"%s\": %s", segment_path, strerror(errno));
+        return -1;
+    }
+
+    if (segment >= log_segment_count) {
+        log_segments = realloc(log_segments, (segment + 1) * sizeof(log_segment));
+        while (log_segment_count <= segment) {
+            memset(&log_segments[log_segment_count], 0, sizeof(log_segment));
+            log_segments[log_segment_count++].fd = -1;
+        }
+    }
+    fstat(fd, &segment_stat);
+    log_segments[segment].fd = fd;
+    log_segments[segment].size = segment_stat.st_size;
+    return 0;
+}
+
+/**
+ * @fn char *log_gather(log_entry *entry, size_t *length)
+ * @brief Read the contents of a path in the log-structured store from its records.
+ *        The caller must hold log_lock.
+ * @param entry The index entry of the path.
+ * @param length Set to the length of the contents.
+ * @return The contents, to be freed by the caller, or NULL on failure.
+ */
+char *log_gather(log_entry *entry, size_t *length) {
+    char *contents;
+    int index;
+
+    *length = 0;
+    for (index = 0; index < entry->extent_count; index++)
+        *length += entry->extents[index].data_len;
+    contents = malloc(*length + 1);
+
+    *length = 0;
+    for (index = 0; index < entry->extent_count; index++) {
+        if (pread(log_segments[entry->extents[index].segment].fd, contents + *length,
+                  entry->extents[index].data_len, LOG_DATA(&entry->extents[index])) != entry->extents[index].data_len) {
+            print_log(1, "log_store", "Cannot read a record of \"%s\".", entry->path);
+            free(contents);
+            return NULL;
+        }
+        *length += entry->extents[index].data_len;
+    }
+    return contents;
+}
+
+/**
+ * @fn int log_write(log_entry *entry, int type, char *data, size_t data_len)
+ * @brief Append a record for a path to the active segment, sealing it and starting
+ *        a new one if it is full, and apply the record to the index. A path has room
+ *        for LOG_EXTENTS records in the index; an append beyond that rewrites the path
+ *        whole, as a single reset record. The caller must hold log_lock for writing.
+ * @param entry The index entry of the path, from log_modify().
+ * @param type LOG_APPEND, LOG_RESET or LOG_REMOVE.
+ * @param data The record's data.
+ * @param data_len The length of the data.
+ * @return 0 on success, -1 on failure.
+ */
+int log_write(log_entry *entry, int type, char *data, size_t data_len) {
+    log_header header = {LOG_MAGIC, data_len, strlen(entry->path), type, 0};
+    log_extent extent;
+    char *record, *contents;
+    size_t length = sizeof(log_header) + header.path_len + data_len;
+    ssize_t written;
+    int return_value;
+
+    if (type == LOG_APPEND && entry->extent_count == LOG_EXTENTS) {
+        contents = log_gather(entry, &length);
+        if (contents == NULL)
+            return -1;
+        contents = realloc(contents, length + data_len);
+        memcpy(contents + length, data, data_len);
+        return_value = log_write(entry, LOG_RESET, contents, length + data_len);
+        free(contents);
+        return return_value;
+    }
+
+    if (log_segments[log_active].size >= LOG_SEGMENT_SIZE && log_open_segment(log_active + 1) == 0) {
+        log_active++;
+        pthread_cond_signal(&log_compact_ready);
+    }
+
+    // Write the whole record at once, so that it is either complete or torn at the end
+    record = malloc(length);
+    memcpy(record, &header, sizeof(log_header));
+    memcpy(record + sizeof(log_header), entry->path, header.path_len);
+    memcpy(record + sizeof(log_header) + header.path_len, data, data_len);
+    memset(&extent, 0, sizeof(log_extent));
+    extent.segment = log_active;
+    extent.offset = log_segments[log_active].size;
+    extent.length = length;
+    extent.data_len = data_len;
+    written = pwrite(log_segments[log_active].fd, record, length, extent.offset);
+    free(record);
+    if (written != (ssize_t)length) {
+        print_log(1, "log_store", "Cannot append to segment %d: %s", log_active, strerror(errno));
+        return -1;
+    }
+
+    log_segments[log_active].size += length;
+    log_segments[log_active].unsynced = 1;
+    log_link(entry, type, &extent);
+    __sync_fetch_and_add(&stat_log_records, 1);
+
+    // Have the compactor write a checkpoint once enough entries have changed
+    if (log_dirty_count == LOG_CHECKPOINT_PATHS)
+        pthread_cond_signal(&log_compact_ready);
+    return 0;
+}
+
+/**
+ * @fn int log_append(char *path, char *data, size_t data_len)
+ * @brief Append data to a file in the log-structured store, creating the file if needed.
+ * @param path The file path.
+ * @param data The data to append.
+ * @param data_len The length of the data.
+ * @return 0 on success, -1 on failure.
+ */
+int log_append(char *path, char *data, size_t data_len) {
+    int return_value = -1;
+
+    pthread_rwlock_wrlock(&log_lock);
+    if (strlen(path) < LOG_PATH_MAX)
+        return_value = log_write(log_modify(path, 1), LOG_APPEND, data, data_len);
+    pthread_rwlock_unlock(&log_lock);
+    return return_value;
+}
+
+/**
+ * @fn int log_truncate(char *path)
+ * @brief Empty a file in the log-structured store by writing a tombstone for it.
+ *        Missing files are left alone.
+ * @param path The file path.
+ * @return 0 on success, -1 on failure.
+ */
+int log_truncate(char *path) {
+    log_entry *entry;
+    int return_value = 0;
+
+    pthread_rwlock_wrlock(&log_lock);
+    entry = log_modify(path, 0);
+    if (entry != NULL)
+        return_value = log_write(entry, LOG_RESET, "", 0);
+    pthread_rwlock_unlock(&log_lock);
+    return return_value;
+}
+
+/**
+ * @fn int log_remove(char *path)
+ * @brief Delete a file from the log-structured store. Missing files are left alone.
+ * @param path The file path.
+ * @return 0 on success, -1 on failure.
+ */
+int log_remove(char *path) {
+    log_entry *entry;
+    int return_value = 0;
+
+    pthread_rwlock_wrlock(&log_lock);
+    entry = log_modify(path, 0);
+    if (entry != NULL)
+        return_value = log_write(entry, LOG_REMOVE, "", 0);
+    pthread_rwlock_unlock(&log_lock);
+    return return_value;
+}
+
+/**
+ * @fn int log_sync(char *path)
+ * @brief Make the log-structured store durable, by syncing every segment written
+ *        to since it was last synced. This covers the records of every path.
+ * @param path The file path; unused.
+ * @return 0 on success, -1 on failure.
+ */
+int log_sync(char *path) {
+    int segment, return_value = 0;
+
+    pthread_rwlock_wrlock(&log_lock);
+    for (segment = 0; segment < log_segment_count; segment++) {
+        if (log_segments[segment].fd >= 0 && log_segments[segment].unsynced) {
+            if (fdatasync(log_segments[segment].fd) != 0)
+                return_value = -1;
+            log_segments[segment].unsynced = 0;
+        }
+    }
+    pthread_rwlock_unlock(&log_lock);
+    return return_value;
+}
+
+/**
+ * @fn void log_advise(char *path, int advice)
+ * @brief Pass a posix_fadvise() hint on for the records of a file in their segments.
+ * @param path The file path.
+ * @param advice The hint, e.g. POSIX_FADV_WILLNEED.
+ */
+void log_advise(char *path, int advice) {
+    log_entry *entry;
+    log_extent *extent;
+    int index;
+
+    pthread_rwlock_rdlock(&log_lock);
+    entry = log_find(path);
+    for (index = 0; entry != NULL && index < entry->extent_count; index++) {
+        extent = &entry->extents[index];
+        posix_fadvise(log_segments[extent->segment].fd, LOG_DATA(extent), extent->data_len, advice);
+    }
+    pthread_rwlock_unlock(&log_lock);
+}
+
+/**
+ * @fn char *log_read(char *path, size_t *length)
+ * @brief Read the contents of a file in the log-structured store.
+ * @param path The file path.
+ * @param length Set to the length of the contents.
+ * @return The contents, to be freed by the caller, or NULL if the file does not exist.
+ */
+char *log_read(char *path, size_t *length) {
+    log_entry *entry;
+    char *contents = NULL;
+
+    pthread_rwlock_rdlock(&log_lock);
+    entry = log_find(path);
+    if (entry != NULL)
+        contents = log_gather(entry, length);
+    pthread_rwlock_unlock(&log_lock);
+    return contents;
+}
+
+/**
+ * @fn ssize_t log_read_range(char *path, char *buf, size_t length, off_t offset)
+ * @brief Read part of a file in the log-structured store, from the records it spans.
+ * @param path The file path.
+ * @param buf Buffer to read into.
+ * @param length Number of bytes to read.
+ * @param offset Offset in the file to start reading at.
+ * @return Number of bytes read, or -1 if the file does not exist or cannot be read.
+ */
+ssize_t log_read_range(char *path, char *buf, size_t length, off_t offset) {
+    log_entry *entry;
+    log_extent *extent;
+    size_t done = 0, piece;
+    int index;
+
+    pthread_rwlock_rdlock(&log_lock);
+    entry = log_find(path);
+    for (index = 0; entry != NULL && index < entry->extent_count && done < length; index++) {
+        extent = &entry->extents[index];
+        if (offset >= extent->data_len) {
+            offset -= extent->data_len;
+            continue;
+        }
+        piece = extent->data_len - offset < length - done ? extent->data_len - offset : length - done;
+        if (pread(log_segments[extent->segment].fd, buf + done, piece, LOG_DATA(extent) + offset) != piece)
+            break;
+        done += piece;
+        offset = 0;
+    }
+    pthread_rwlock_unlock(&log_lock);
+    return entry == NULL ? -1 : (ssize_t)done;
+}
+
+/**
+ * @fn int log_size(char *path, size_t *size)
+ * @brief Determine the size of a file in the log-structured store.
+ * @param path The file path.
+ * @param size Set to the size of the file.
+ * @return 0 on success, -1 if the file does not exist.
+ */
+int log_size(char *path, size_t *size) {
+    log_entry *entry;
+    int index;
+
+    pthread_rwlock_rdlock(&log_lock);
+    entry = log_find(path);
+    *size = 0;
+    for (index = 0; entry != NULL && index < entry->extent_count; index++)
+        *size += entry->extents[index].data_len;
+    pthread_rwlock_unlock(&log_lock);
+    return entry == NULL ? -1 : 0;
+}
+
+/**
+ * @fn int log_exists(char *path)
+ * @brief Check whether a file exists in the log-structured store.
+ * @param path The file path.
+ * @return Non-zero if the file exists.
+ */
+int log_exists(char *path) {
+    int exists;
+
+    pthread_rwlock_rdlock(&log_lock);
+    exists = log_find(path) != NULL;
+    pthread_rwlock_unlock(&log_lock);
+    return exists;
+}
+
+/**
+ * @fn void log_glob(char *pattern, glob_t *matches)
+ * @brief Add the paths in the log-structured store matching a glob pattern to matches,
+ *        or the pattern itself if none match.
+ * @param pattern The glob pattern.
+ * @param matches The list of matches.
+ */
+void log_glob(char *pattern, glob_t *matches) {
+    log_dirty *dirty;
+    size_t first = matches->gl_pathc;
+    unsigned long slot;
+    int bucket;
+
+    pthread_rwlock_rdlock(&log_lock);
+    for (bucket = 0; bucket < LOG_BUCKETS; bucket++) {
+        for (dirty = log_dirty_table[bucket]; dirty != NULL; dirty = dirty->next) {
+            if (dirty->entry.used == LOG_REMOVED || fnmatch(pattern, dirty->entry.path, 0) != 0)
+                continue;
+            matches->gl_pathv = realloc(matches->gl_pathv, (matches->gl_pathc + 1) * sizeof(char *));
+            matches->gl_pathv[matches->gl_pathc++] = strdup(dirty->entry.path);
+        }
+    }
+
+    // Paths in the dirty table have been listed already
+    for (slot = 0; slot < log_index->slot_count; slot++) {
+        if (!log_slots[slot].used || fnmatch(pattern, log_slots[slot].path, 0) != 0 ||
+            log_find(log_slots[slot].path) != &log_slots[slot])
+            continue;
+        matches->gl_pathv = realloc(matches->gl_pathv, (matches->gl_pathc + 1) * sizeof(char *));
+        matches->gl_pathv[matches->gl_pathc++] = strdup(log_slots[slot].path);
+    }
+    pthread_rwlock_unlock(&log_lock);
+
+    if (matches->gl_pathc == first) {
+        matches->gl_pathv = realloc(matches->gl_pathv, (matches->gl_pathc + 1) * sizeof(char *));
+        matches->gl_pathv[matches->gl_pathc++] = strdup(pattern);
+    }
+}
+
+/**
+ * @fn int log_map_index(char *index_path, unsigned long slot_count)
+ * @brief Map an on-disk index file, creating it with slot_count empty slots
+ *        if it does not exist yet. The mapping replaces the current one, if any.
+ * @param index_path Path to the index file.
+ * @param slot_count Number of slots of a new index; must be a power of two.
+ * @return 0 on success, -1 on failure.
+ */
+int log_map_index(char *index_path, unsigned long slot_count) {
+    struct stat index_stat;
+    log_index_header *header;
+    size_t size;
+    int fd;
+
+    fd = open(index_path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0 || fstat(fd, &index_stat) != 0) {
+        print_log(1, "log_store", "Cannot open index \"%s\": %s", index_path, strerror(errno));
+        return -1;
+    }
+    size = index_stat.st_size;
+    if (size == 0) {
+        size = LOG_SLOT_SIZE + slot_count * LOG_SLOT_SIZE;
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        print_log(1, "log_store", "Cannot map index \"%s\": %s", index_path, strerror(errno));
+        return -1;
+    }
+    if (header->magic != LOG_INDEX_MAGIC) {
+        header->magic = LOG_INDEX_MAGIC;
+        header->slot_count = slot_count;
+        header->used_count = 0;
+        header->checkpoint_segment = 0;
+        header->checkpoint_offset = 0;
+    }
+
+    if (log_index != NULL)
+        munmap(log_index, log_index_size);
+    log_index = header;
+    log_index_size = size;
+    log_slots = (log_entry *)((char *)header + LOG_SLOT_SIZE);
+    return 0;
+}
+
+/**
+ * @fn void log_store_entry(log_entry *entry)
+ * @brief Write an index entry into its slot of the mapped on-disk index,
+ *        claiming a free slot if the path is new. The index must have room for it.
+ * @param entry The index entry.
+ */
+void log_store_entry(log_entry *entry) {
+    log_entry *slot = log_slot(entry->path, 1);
+
+    if (!slot->used)
+        log_index->used_count++;
+    *slot = *entry;
+}
+
+/**
+ * @fn int log_grow_index(unsigned long slot_count)
+ * @brief Rebuild the on-disk index with more slots, copying the entries in use into it.
+ *        The caller stores the dirty entries afterwards. The new index is written next to
+ *        the old one and renamed over it, so a crash leaves either of them intact, and the
+ *        old one stays in use if the rename fails. The caller must hold log_lock for writing.
+ * @param slot_count The new number of slots; must be a power of two.
+ * @return 0 on success, -1 on failure.
+ */
+int log_grow_index(unsigned long slot_count) {
+    log_index_header *old_index = log_index;
+    log_entry *old_slots = log_slots;
+    size_t old_size = log_index_size;
+    unsigned long slot;
+
+    unlink(LOG_DIR "/index.tmp");
+    log_index = NULL;
+    if (log_map_index(LOG_DIR "/index.tmp", slot_count) != 0) {
+        log_index = old_index;
+        return -1;
+    }
+    for (slot = 0; slot < old_index->slot_count; slot++)
+        if (old_slots[slot].used)
+            log_store_entry(&old_slots[slot]);
+    log_index->checkpoint_segment = old_index->checkpoint_segment;
+    log_index->checkpoint_offset = old_index->checkpoint_offset;
+    msync(log_index, log_index_size, MS_SYNC);
+    if (rename(LOG_DIR "/index.tmp", LOG_DIR "/index") != 0) {
+        print_log(1, "log_store", "Cannot replace index: %s", strerror(errno));
+        munmap(log_index, log_index_size);
+        unlink(LOG_DIR "/index.tmp");
+        log_index = old_index;
+        log_slots = old_slots;
+        log_index_size = old_size;
+        return -1;
+    }
+    munmap(old_index, old_size);
+    print_log(0, "log_store", "Index grown to %lu slots.", slot_count);
+    return 0;
+}
+
+/**
+ * @fn int log_write_live(int segment, off_t offset)
+ * @brief Save the live counts of the segments, as of a checkpoint position.
+ * @param segment Segment of the checkpoint position.
+ * @param offset Offset of the checkpoint position.
+ * @return 0 on success, -1 on failure.
+ */
+int log_write_live(int segment, off_t offset) {
+    FILE *live_file = fopen(LOG_DIR "/live.tmp", "w");
+    unsigned int magic = LOG_INDEX_MAGIC;
+    int index;
+
+    if (live_file == NULL)
+        return -1;
+    fwrite(&magic, sizeof(magic), 1, live_file);
+    fwrite(&segment, sizeof(segment), 1, live_file);
+    fwrite(&offset, sizeof(offset), 1, live_file);
+    fwrite(&log_segment_count, sizeof(log_segment_count), 1, live_file);
+    for (index = 0; index < log_segment_count; index++)
+        fwrite(&log_segments[index].live, sizeof(off_t), 1, live_file);
+    fflush(live_file);
+    fdatasync(fileno(live_file));
+    fclose(live_file);
+    return rename(LOG_DIR "/live.tmp", LOG_DIR "/live");
+}
+
+/**
+ * @fn int log_read_live()
+ * @brief Load the live counts of the segments saved at the last checkpoint.
+ * @return 0 on success, -1 if they are missing or from another checkpoint.
+ */
+int log_read_live() {
+    FILE *live_file = fopen(LOG_DIR "/live", "r");
+    unsigned int magic = 0;
+    int segment = -1, count = 0, index;
+    off_t offset = -1, live;
+
+    if (live_file == NULL)
+        return -1;
+    if (fread(&magic, sizeof(magic), 1, live_file) != 1 || fread(&segment, sizeof(segment), 1, live_file) != 1 ||
+        fread(&offset, sizeof(offset), 1, live_file) != 1 || fread(&count, sizeof(count), 1, live_file) != 1 ||
+        magic != LOG_INDEX_MAGIC || segment != log_index->checkpoint_segment || offset != log_index->checkpoint_offset) {
+        fclose(live_file);
+        return -1;
+    }
+    for (index = 0; index < count && fread(&live, sizeof(live), 1, live_file) == 1; index++)
+        if (index < log_segment_count)
+            log_segments[index].live = live;
+    fclose(live_file);
+    return index == count ? 0 : -1;
+}
+
+/**
+ * @fn int log_checkpoint()
+ * @brief Write the dirty entries into the on-disk index, and move its checkpoint position
+ *        to the end of the log. The entries are first written to a write-ahead log
+ *        (index.wal), so that a crash while the index is being updated can be repaired
+ *        on recovery by writing them again. The caller must hold log_lock for writing.
+ * @return 0 on success, -1 on failure.
+ */
+int log_checkpoint() {
+    log_dirty *dirty, *next;
+    unsigned long slot_count = log_index->slot_count;
+    unsigned int magic = LOG_INDEX_MAGIC;
+    int segment = log_active, bucket, count = 0;
+    off_t offset = log_segments[log_active].size;
+    FILE *wal;
+
+    // The segments must hold every record the checkpoint covers
+    for (bucket = 0; bucket < log_segment_count; bucket++) {
+        if (log_segments[bucket].fd >= 0 && log_segments[bucket].unsynced) {
+            fdatasync(log_segments[bucket].fd);
+            log_segments[bucket].unsynced = 0;
+        }
+    }
+
+    // Log the dirty entries ahead of writing them into the index.
+    // The trailing magic number marks the write-ahead log as complete.
+    wal = fopen(LOG_DIR "/index.wal", "w");
+    if (wal == NULL)
+        return -1;
+    fwrite(&segment, sizeof(segment), 1, wal);
+    fwrite(&offset, sizeof(offset), 1, wal);
+    fwrite(&log_dirty_count, sizeof(log_dirty_count), 1, wal);
+    for (bucket = 0; bucket < LOG_BUCKETS; bucket++)
+        for (dirty = log_dirty_table[bucket]; dirty != NULL; dirty = dirty->next)
+            fwrite(&dirty->entry, sizeof(log_entry), 1, wal), count++;
+    fwrite(&magic, sizeof(magic), 1, wal);
+    fflush(wal);
+    fdatasync(fileno(wal));
+    fclose(wal);
+
+    // Keep the index at most half full, so probing stays short
+    while ((log_index->used_count + count) * 2 > slot_count)
+        slot_count *= 2;
+    if (slot_count != log_index->slot_count && log_grow_index(slot_count) != 0)
+        return -1;
+
+    // Write the entries into the index
+    for (bucket = 0; bucket < LOG_BUCKETS; bucket++) {
+        for (dirty = log_dirty_table[bucket]; dirty != NULL; dirty = next) {
+            next = dirty->next;
+            log_store_entry(&dirty->entry);
+            free(dirty);
+        }
+        log_dirty_table[bucket] = NULL;
+    }
+    log_dirty_count = 0;
+
+    // Move the checkpoint position, once the index and live counts are on disk
+    if (log_write_live(segment, offset) != 0)
+        print_log(1, "log_store", "Cannot save segment live counts.");
+    msync(log_index, log_index_size, MS_SYNC);
+    log_index->checkpoint_segment = segment;
+    log_index->checkpoint_offset = offset;
+    msync(log_index, LOG_SLOT_SIZE, MS_SYNC);
+    unlink(LOG_DIR "/index.wal");
+    __sync_fetch_and_add(&stat_log_checkpoints, 1);
+    print_log(0, "log_store", "Checkpoint of %d index entries at segment %d, offset %lld.", count, segment, (long long)offset);
+    return 0;
+}
+
+/**
+ * @fn void log_replay_wal()
+ * @brief Repair the on-disk index after a crash during a checkpoint, by writing the
+ *        entries of a complete write-ahead log into it again. Writing an entry twice
+ *        is harmless, since it always replaces the whole slot.
+ */
+void log_replay_wal() {
+    FILE *wal = fopen(LOG_DIR "/index.wal", "r");
+    log_entry *entries;
+    unsigned int magic = 0;
+    int segment, count, index;
+    off_t offset;
+    unsigned long slot_count;
+
+    if (wal == NULL)
+        return;
+    if (fread(&segment, sizeof(segment), 1, wal) != 1 || fread(&offset, sizeof(offset), 1, wal) != 1 ||
+        fread(&count, sizeof(count), 1, wal) != 1 || count < 0) {
+        fclose(wal);
+        unlink(LOG_DIR "/index.wal");
+        return;
+    }
+    entries = malloc((count + 1) * sizeof(log_entry));
+    if (fread(entries, sizeof(log_entry), count, wal) != count || fread(&magic, sizeof(magic), 1, wal) != 1 ||
+        magic != LOG_INDEX_MAGIC) {
+        // The checkpoint never got to change the index
+        print_log(1, "log_store", "Discarding incomplete index write-ahead log.");
+    } else {
+        print_log(1, "log_store", "Finishing an interrupted checkpoint of %d index entries.", count);
+        for (slot_count = log_index->slot_count; (log_index->used_count + count) * 2 > slot_count; )
+            slot_count *= 2;
+        if (slot_count == log_index->slot_count || log_grow_index(slot_count) == 0) {
+            for (index = 0; index < count; index++)
+                log_store_entry(&entries[index]);
+            msync(log_index, log_index_size, MS_SYNC);
+            log_index->checkpoint_segment = segment;
+            log_index->checkpoint_offset = offset;
+            msync(log_index, LOG_SLOT_SIZE, MS_SYNC);
+        }
+    }
+    free(entries);
+    fclose(wal);
+    unlink(LOG_DIR "/index.wal");
+}
+
+/**
+ * @fn void log_compact(int segment)
+ * @brief Rewrite the live records of a sealed segment at the end of the log, then
+ *        delete the segment. Each path with a live record in the segment is rewritten
+ *        whole, as a single reset record, which also makes its other records dead.
+ *        The caller must hold log_lock for writing.
+ * @param segment The segment number.
+ */
+void log_compact(int segment) {
+    log_header header;
+    log_entry *entry;
+    char path[LOG_PATH_MAX], *contents, segment_path[64];
+    size_t length;
+    off_t offset;
+    int index;
+
+    // log_write() may grow log_segments, so the victim is looked up anew each time
+    for (offset = 0; offset < log_segments[segment].size && log_segments[segment].live > 0;
+         offset += sizeof(log_header) + header.path_len + header.data_len) {
+        if (pread(log_segments[segment].fd, &header, sizeof(log_header), offset) != sizeof(log_header) ||
+            header.magic != LOG_MAGIC || header.path_len >= sizeof(path) ||
+            pread(log_segments[segment].fd, path, header.path_len, offset + sizeof(log_header)) != header.path_len)
+            break;
+        path[header.path_len] = '\0';
+
+        // Only records still in the index are live
+        entry = log_find(path);
+        if (entry == NULL)
+            continue;
+        for (index = 0; index < entry->extent_count; index++)
+            if (entry->extents[index].segment == segment && entry->extents[index].offset == offset)
+                break;
+        if (index == entry->extent_count)
+            continue;
+
+        entry = log_modify(path, 0);
+        contents = log_gather(entry, &length);
+        if (contents == NULL || log_write(entry, LOG_RESET, contents, length) != 0) {
+            // Keep the segment; it still holds data we could not move
+            free(contents);
+            return;
+        }
+        free(contents);
+    }
+    // The on-disk index may still refer to the segment until the next checkpoint
+    if (log_segments[segment].live > 0 || log_checkpoint() != 0)
+        return;
+
+    // Nothing in the segment is referenced anymore
+    sprintf(segment_path, "%s/%08d.seg", LOG_DIR, segment);
+    unlink(segment_path);
+    close(log_segments[segment].fd);
+    log_segments[segment].fd = -1;
+    __sync_fetch_and_add(&stat_log_compactions, 1);
+    __sync_fetch_and_add(&stat_log_reclaimed, log_segments[segment].size);
+    print_log(0, "log_store", "Compacted segment %d, reclaiming %lld bytes.", segment, (long long)log_segments[segment].size);
+}
+
+/**
+ * @fn void *log_compactor(void *arg)
+ * @brief Compactor thread of the log-structured store. Every LOG_COMPACT_MS milliseconds,
+ *        or whenever a segment is sealed, it compacts the sealed segments that are
+ *        at least half dead, one at a time. It also writes a checkpoint once
+ *        LOG_CHECKPOINT_PATHS index entries have changed since the last one.
+ * @param arg Unused.
+ */
+void *log_compactor(void *arg) {
+    struct timespec wake;
+    int segment;
+
+    pthread_mutex_lock(&log_compact_lock);
+    while (!log_closed) {
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += LOG_COMPACT_MS * 1000000L;
+        if (wake.tv_nsec >= 1000000000) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&log_compact_ready, &log_compact_lock, &wake);
+        pthread_mutex_unlock(&log_compact_lock);
+
+        for (segment = 0; !log_closed; segment++) {
+            pthread_rwlock_wrlock(&log_lock);
+            if (segment >= log_active) {
+                pthread_rwlock_unlock(&log_lock);
+                break;
+            }
+            if (log_segments[segment].fd >= 0 && log_segments[segment].live * 2 <= log_segments[segment].size)
+                log_compact(segment);
+            pthread_rwlock_unlock(&log_lock);
+        }
+
+        pthread_rwlock_wrlock(&log_lock);
+        if (log_dirty_count >= LOG_CHECKPOINT_PATHS)
+            log_checkpoint();
+        pthread_rwlock_unlock(&log_lock);
+        pthread_mutex_lock(&log_compact_lock);
+    }
+    pthread_mutex_unlock(&log_compact_lock);
+    return NULL;
+}
+
+/**
+ * @fn int log_recover()
+ * @brief Open the log-structured store. The on-disk index is mapped as-is, and only
+ *        the records written after its checkpoint position are replayed, so recovery
+ *        time depends on the checkpoint interval rather than on the number of paths.
+ *        A segment ending in a torn record, e.g. after a crash, is cut off before it.
+ * @return 0 on success, -1 on failure.
+ */
+int log_recover() {
+    DIR *dir;
+    struct dirent *dirent;
+    log_header header;
+    log_extent extent;
+    char path[LOG_PATH_MAX];
+    FILE *segment_file;
+    unsigned long slot;
+    int segment, index, last = -1;
+
+    if (mkdir(LOG_DIR, 0777) != 0 && errno != EEXIST) {
+        print_log(1, "log_store", "Cannot create \"%s\": %s", LOG_DIR, strerror(errno));
+        return -1;
+    }
+    if (log_map_index(LOG_DIR "/index", LOG_INDEX_SLOTS) != 0)
+        return -1;
+    log_replay_wal();
+
+    // Open the segments. Compaction leaves gaps in the numbering.
+    dir = opendir(LOG_DIR);
+    if (dir == NULL)
+        return -1;
+    while ((dirent = readdir(dir)) != NULL) {
+        if (sscanf(dirent->d_name, "%d.seg", &segment) != 1 || strstr(dirent->d_name, ".seg") == NULL)
+            continue;
+        if (log_open_segment(segment) != 0) {
+            closedir(dir);
+            return -1;
+        }
+        if (segment > last)
+            last = segment;
+    }
+    closedir(dir);
+    if (last < 0 && log_open_segment(++last) != 0)
+        return -1;
+    log_active = last;
+
+    // The live counts are saved with every checkpoint. If they do not match the index,
+    // the last checkpoint was interrupted, and they are counted from the index instead.
+    if (log_read_live() != 0) {
+        print_log(1, "log_store", "Recounting live bytes from the index.");
+        for (segment = 0; segment < log_segment_count; segment++)
+            log_segments[segment].live = 0;
+        for (slot = 0; slot < log_index->slot_count; slot++)
+            for (index = 0; log_slots[slot].used && index < log_slots[slot].extent_count; index++)
+                if (log_slots[slot].extents[index].segment < log_segment_count)
+                    log_segments[log_slots[slot].extents[index].segment].live += log_slots[slot].extents[index].length;
+    }
+
+    // Replay the records written after the checkpoint
+    for (segment = log_index->checkpoint_segment; segment <= last; segment++) {
+        if (segment >= log_segment_count || log_segments[segment].fd < 0)
+            continue;
+        segment_file = fdopen(dup(log_segments[segment].fd), "r");
+        memset(&extent, 0, sizeof(log_extent));
+        extent.segment = segment;
+        extent.offset = segment == log_index->checkpoint_segment ? log_index->checkpoint_offset : 0;
+        fseeko(segment_file, extent.offset, SEEK_SET);
+        while (fread(&header, sizeof(log_header), 1, segment_file) == 1 && header.magic == LOG_MAGIC &&
+               header.path_len < sizeof(path) && fread(path, 1, header.path_len, segment_file) == header.path_len &&
+               fseeko(segment_file, header.data_len, SEEK_CUR) == 0 &&
+               extent.offset + sizeof(log_header) + header.path_len + header.data_len <= log_segments[segment].size) {
+            path[header.path_len] = '\0';
+            extent.length = sizeof(log_header) + header.path_len + header.data_len;
+            extent.data_len = header.data_len;
+            log_link(log_modify(path, 1), header.type, &extent);
+            extent.offset += extent.length;
+            __sync_fetch_and_add(&stat_log_replayed, 1);
+        }
+        fclose(segment_file);
+
+        if (extent.offset < log_segments[segment].size) {
+            print_log(1, "log_store", "Segment %d has a torn record, cutting it off.", segment);
+            if (ftruncate(log_segments[segment].fd, extent.offset) == 0)
+                log_segments[segment].size = extent.offset;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @fn int log_open()
+ * @brief Open the log-structured store, and start compacting it in the background.
+ * @return 0 on success, -1 on failure.
+ */
+int log_open() {
+    if (log_recover() != 0)
+        return -1;
+    pthread_create(&log_compact_thread, NULL, log_compactor, NULL);
+    return 0;
+}
+
+/**
+ * @fn void log_close()
+ * @brief Stop the compactor, write a last checkpoint, and close the log-structured store.
+ */
+void log_close() {
+    int segment;
+
+    pthread_mutex_lock(&log_compact_lock);
+    log_closed = 1;
+    pthread_cond_signal(&log_compact_ready);
+    pthread_mutex_unlock(&log_compact_lock);
+    pthread_join(log_compact_thread, NULL);
+
+    if (log_checkpoint() != 0)
+        print_log(1, "log_store", "Cannot write a checkpoint; the next start will replay the log.");
+    munmap(log_index, log_index_size);
+    for (segment = 0; segment < log_segment_count; segment++)
+        if (log_segments[segment].fd >= 0)
+            close(log_segments[segment].fd);
+    free(log_segments);
+}
+
+/*****************************
+ *        Buffer pool        *
+ *****************************/
+
+/**
+ * @fn void buffer_pool_init()
+ * @brief Map the region of the buffer pool. Explicit huge pages are tried first, and
+ *        failing that, a region aligned to POOL_ALIGN is mapped with MADV_HUGEPAGE,
+ *        so that transparent huge pages can back it. If both fail, every lease
+ *        falls back to the heap. Called once, on the first lease.
+ */
+void buffer_pool_init() {
+    size_t size = (size_t)POOL_BUFFERS * POOL_BUF_SIZE;
+    char *region;
+    uintptr_t aligned;
+    int index;
+
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED) {
+        pool_huge = 1;
+    } else {
+        // Over-allocate, then trim the region down to an aligned one
+        region = mmap(NULL, size + POOL_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            print_log(1, "buffer_pool", "Cannot map the buffer pool: %s", strerror(errno));
+            return;
+        }
+        aligned = ((uintptr_t)region + POOL_ALIGN - 1) & ~(uintptr_t)(POOL_ALIGN - 1);
+        if (aligned > (uintptr_t)region)
+            munmap(region, aligned - (uintptr_t)region);
+        munmap((char *)aligned + size, (uintptr_t)region + POOL_ALIGN - aligned);
+        region = (char *)aligned;
+        madvise(region, size, MADV_HUGEPAGE);
+    }
+
+    for (index = 0; index < POOL_BUFFERS; index++)
+        pool_free[index] = POOL_BUFFERS - 1 - index;
+    pool_free_count = POOL_BUFFERS;
+    pool_region = region;
+}
+
+/**
+ * @fn char *buffer_lease()
+ * @brief Lease an I/O staging buffer of POOL_BUF_SIZE bytes, aligned to the page size,
+ *        from the buffer pool. If every buffer is leased, one is allocated on the heap.
+ * @return The buffer, to be given back with buffer_release().
+ */
+char *buffer_lease() {
+    char *buf = NULL;
+    int in_use;
+
+    pthread_once(&pool_once, buffer_pool_init);
+    pthread_mutex_lock(&pool_lock);
+    if (pool_free_count > 0) {
+        buf = pool_region + (size_t)pool_free[--pool_free_count] * POOL_BUF_SIZE;
+        in_use = POOL_BUFFERS - pool_free_count;
+        if (in_use > stat_pool_in_use_peak)
+            stat_pool_in_use_peak = in_use;
+    }
+    stat_pool_leases++;
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buf == NULL) {
+        if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), POOL_BUF_SIZE) != 0)
+            return NULL;
+        __sync_fetch_and_add(&stat_pool_fallbacks, 1);
+    }
+    return buf;
+}
+
+/**
+ * @fn void buffer_release(char *buf)
+ * @brief Give a buffer leased with buffer_lease() back.
+ * @param buf The buffer.
+ */
+void buffer_release(char *buf) {
+    if (pool_region == NULL || buf < pool_region ||
+        buf >= pool_region + (size_t)POOL_BUFFERS * POOL_BUF_SIZE) {
+        free(buf);
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_free[pool_free_count++] = (buf - pool_region) / POOL_BUF_SIZE;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*****************************
+ *       Preallocation       *
+ *****************************/
+
+/**
+ * @fn void preallocate(char *path, int fd)
+ * @brief After an append to a file, reserve space past its end with
+ *        fallocate(FALLOC_FL_KEEP_SIZE) once less than half an extent is left, so the
+ *        file grows into contiguous blocks. Each extent is twice the last, up to
+ *        PREALLOC_MAX. User files are only preallocated once they are hot (see
+ *        PREALLOC_HOT). A truncated file starts over from PREALLOC_MIN.
+ *        A user file is only preallocated by its own request (see request_file).
+ *        The caller must hold the file's lock, or be its only writer.
+ * @param path The file path.
+ * @param fd A descriptor of the file, open for writing.
+ */
+void preallocate(char *path, int fd) {
+    struct stat file_stat;
+    time_t now = time(NULL);
+    file_t *file;
+
+    if (strcmp(path, READ_FILE) == 0)
+        file = &server_prealloc[0];
+    else if (strcmp(path, EMPTY_FILE) == 0)
+        file = &server_prealloc[1];
+    else if (strcmp(path, COMMANDS_FILE) == 0)
+        file = &server_prealloc[2];
+    else if (request_file != NULL && strcmp(request_file->path, path) == 0)
+        file = request_file;
+    else
+        return;
+
+    // User files must be hot first
+    if (!is_server_file(path) && file->pa_extent == 0) {
+        if (file->pa_window != now) {
+            file->pa_window = now;
+            file->pa_count = 0;
+        }
+        if (++file->pa_count < PREALLOC_HOT)
+            return;
+    }
+
+    if (fstat(fd, &file_stat) != 0)
+        return;
+    if (file_stat.st_size < file->pa_base)
+        file->pa_extent = file->pa_end = 0;
+    if (file->pa_extent > 0 && file_stat.st_size + file->pa_extent / 2 < file->pa_end)
+        return;
+
+    file->pa_extent = file->pa_extent == 0 ? PREALLOC_MIN :
+                      file->pa_extent < PREALLOC_MAX ? file->pa_extent * 2 : PREALLOC_MAX;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, file_stat.st_size, file->pa_extent) != 0) {
+        // Unsupported by the filesystem, so do not try again
+        file->pa_end = (off_t)1 << 62;
+        file->pa_base = 0;
+        return;
+    }
+    file->pa_base = file_stat.st_size;
+    file->pa_end = file_stat.st_size + file->pa_extent;
+    __sync_fetch_and_add(&stat_prealloc_extents, 1);
+    __sync_fetch_and_add(&stat_prealloc_bytes, file->pa_extent);
+}
+
+/*****************************
+ *      Storage engines      *
+ *****************************/
+
+/**
+ * @fn int posix_append(char *path, char *data, size_t length)
+ * @brief Append data to a file, creating it if needed.
+ * @param path The file path.
+ * @param data The data to append.
+ * @param length The length of the data.
+ * @return 0 on success, -1 on failure.
+ */
+int posix_append(char *path, char *data, size_t length) {
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    ssize_t written;
+
+    if (fd < 0) {
+        // Could not open file. Print error.
+        print_log(1, "write_file", "Cannot open file \"%s\" for writing.", path);
+        return -1;
+    }
+
+    // Appends are written as they are, without going through a stdio buffer
+    while (length > 0 && (written = write(fd, data, length)) > 0) {
+        data += written;
+        length -= written;
+    }
+    preallocate(path, fd);
+    close(fd);
+    return 0;
+}
+
+/**
+ * @fn char *posix_read_all(char *path, size_t *length)
+ * @brief Read the contents of a file.
+ * @param path The file path.
+ * @param length Set to the length of the contents.
+ * @return The contents, to be freed by the caller, or NULL if the file cannot be read.
+ */
+char *posix_read_all(char *path, size_t *length) {
+    FILE *file = fopen(path, "r");
+    struct stat file_stat;
+    char *contents;
+
+    if (file == NULL)
+        return NULL;
+    if (fstat(fileno(file), &file_stat) != 0) {
+        fclose(file);
+        return NULL;
+    }
+    contents = malloc(file_stat.st_size + 1);
+    *length = fread(contents, 1, file_stat.st_size, file);
+    fclose(file);
+    return contents;
+}
+
+/**
+ * @fn ssize_t posix_read_range(char *path, char *buf, size_t length, off_t offset)
+ * @brief Read part of a file.
+ * @param path The file path.
+ * @param buf Buffer to read into.
+ * @param length Number of bytes to read.
+ * @param offset Offset in the file to start reading at.
+ * @return Number of bytes read, or -1 if the file cannot be read.
+ */
+ssize_t posix_read_range(char *path, char *buf, size_t length, off_t offset) {
+    ssize_t read_size;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+    read_size = pread(fd, buf, length, offset);
+    close(fd);
+    return read_size;
+}
+
+/**
+ * @fn int posix_truncate(char *path)
+ * @brief Empty a file.
+ * @param path The file path.
+ * @return 0 on success, -1 on failure.
+ */
+int posix_truncate(char *path) {
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL) {
+        // Could not open file. Print error.
+        print_log(1, "empty_file", "Cannot open file \"%s\" for emptying.", path);
+        return -1;
+    }
+
+    // Since we opened the file with the "w" flag,
+    // the system empties the file for us if it already exists,
+    // and thus all that is left to do is close it.
+    fclose(file);
+    return 0;
+}
+
+/**
+ * @fn int posix_remove(char *path)
+ * @brief Delete a file. Missing files are left alone.
+ * @param path The file path.
+ * @return 0 on success, -1 on failure.
+ */
+int posix_remove(char *path) {
+    return unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+/**
+ * @fn int posix_sync(char *path)
+ * @brief Make the contents of a file durable. Missing files are left alone.
+ * @param path The file path.
+ * @return 0 on success, -1 on failure.
+ */
+int posix_sync(char *path) {
+    int fd = open(path, O_RDONLY), return_value;
+
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    return_value = fdatasync(fd);
+    close(fd);
+    return return_value;
+}
+
+/**
+ * @fn void posix_advise(char *path, int advice)
+ * @brief Pass a posix_fadvise() hint on for a whole file. Missing files are left alone.
+ * @param path The file path.
+ * @param advice The hint, e.g. POSIX_FADV_WILLNEED.
+ */
+void posix_advise(char *path, int advice) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, advice);
+    close(fd);
+}
+
+/**
+ * @fn int posix_exists(char *path)
+ * @brief Check whether a file exists.
+ * @param path The file path.
+ * @return Non-zero if the file exists.
+ */
+int posix_exists(char *path) {
+    return access(path, F_OK) == 0;
+}
+
+/**
+ * @fn int posix_stat(char *path, size_t *size)
+ * @brief Determine the size of a file.
+ * @param path The file path.
+ * @param size Set to the size of the file.
+ * @return 0 on success, -1 if the file does not exist.
+ */
+int posix_stat(char *path, size_t *size) {
+    struct stat file_stat;
+
+    if (stat(path, &file_stat) != 0)
+        return -1;
+    *size = file_stat.st_size;
+    return 0;
+}
+
+/**
+ * @fn void posix_glob(char *pattern, glob_t *matches)
+ * @brief Add the files matching a glob pattern to matches, or the pattern itself if none match.
+ * @param pattern The glob pattern.
+ * @param matches The list of matches.
+ */
+void posix_glob(char *pattern, glob_t *matches) {
+    glob_t found;
+    size_t match;
+
+    if (glob(pattern, GLOB_NOCHECK, NULL, &found) != 0) {
+        found.gl_pathc = 0;
+        found.gl_pathv = NULL;
+    }
+    matches->gl_pathv = realloc(matches->gl_pathv, (matches->gl_pathc + found.gl_pathc + 1) * sizeof(char *));
+    for (match = 0; match < found.gl_pathc; match++)
+        matches->gl_pathv[matches->gl_pathc++] = strdup(found.gl_pathv[match]);
+    if (found.gl_pathc == 0)
+        matches->gl_pathv[matches->gl_pathc++] = strdup(pattern);
+    else
+        globfree(&found);
+}
+
+/**
+ * @fn memory_file *memory_find(char *path, int create)
+ * @brief Look up a file in the in-memory engine.
+ *        The caller must hold memory_lock, for writing if create is non-zero.
+ * @param path The file path.
+ * @param create Set to a non-zero value to create the file if it does not exist.
+ * @return The file, or NULL if it does not exist.
+ */
+memory_file *memory_find(char *path, int create) {
+    memory_file **bucket = &memory_files[hash_path(path) % MEMORY_BUCKETS], *file;
+
+    for (file = *bucket; file != NULL; file = file->next)
+        if (strcmp(file->path, path) == 0)
+            return file;
+    if (!create)
+        return NULL;
+
+    file = calloc(1, sizeof(memory_file));
+    file->path = strdup(path);
+    file->next = *bucket;
+    *bucket = file;
+    return file;
+}
+
+/**
+ * @fn int memory_append(char *path, char *data, size_t length)
+ * @brief Append data to a file in the in-memory engine, creating it if needed.
+ * @param path The file path.
+ * @param data The data to append.
+ * @param length The length of the data.
+ * @return 0.
+ */
+int memory_append(char *path, char *data, size_t length) {
+    memory_file *file;
+
+    pthread_rwlock_wrlock(&memory_lock);
+    file = memory_find(path, 1);
+    if (file->length + length > file->capacity) {
+        file->capacity = file->length + length > 2 * file->capacity ? file->length + length : 2 * file->capacity;
+        file->data = realloc(file->data, file->capacity);
+    }
+    memcpy(file->data + file->length, data, length);
+    file->length += length;
+    pthread_rwlock_unlock(&memory_lock);
+    return 0;
+}
+
+/**
+ * @fn char *memory_read_all(char *path, size_t *length)
+ * @brief Read the contents of a file in the in-memory engine.
+ * @param path The file path.
+ * @param length Set to the length of the contents.
+ * @return A copy of the contents, to be freed by the caller, or NULL if the file does not exist.
+ */
+char *memory_read_all(char *path, size_t *length) {
+    memory_file *file;
+    char *contents = NULL;
+
+    pthread_rwlock_rdlock(&memory_lock);
+    file = memory_find(path, 0);
+    if (file != NULL) {
+        contents = malloc(file->length + 1);
+        memcpy(contents, file->data, file->length);
+        *length = file->length;
+    }
+    pthread_rwlock_unlock(&memory_lock);
+    return contents;
+}
+
+/**
+ * @fn ssize_t memory_read_range(char *path, char *buf, size_t length, off_t offset)
+ * @brief Read part of a file in the in-memory engine.
+ * @param path The file path.
+ * @param buf Buffer to read into.
+ * @param length Number of bytes to read.
+ * @param offset Offset in the file to start reading at.
+ * @return Number of bytes read, or -1 if the file does not exist.
+ */
+ssize_t memory_read_range(char *path, char *buf, size_t length, off_t offset) {
+    memory_file *file;
+    ssize_t read_size = -1;
+
+    pthread_rwlock_rdlock(&memory_lock);
+    file = memory_find(path, 0);
+    if (file != NULL) {
+        read_size = offset >= file->length ? 0 : file->length - offset < length ? file->length - offset : length;
+        memcpy(buf, file->data + offset, read_size);
+    }
+    pthread_rwlock_unlock(&memory_lock);
+    return read_size;
+}
+
+/**
+ * @fn int memory_truncate(char *path)
+ * @brief Empty a file in the in-memory engine, keeping its buffer for later appends.
+ * @param path The file path.
+ * @return 0.
+ */
+int memory_truncate(char *path) {
+    memory_file *file;
+
+    pthread_rwlock_wrlock(&memory_lock);
+    file = memory_find(path, 0);
+    if (file != NULL)
+        file->length = 0;
+    pthread_rwlock_unlock(&memory_lock);
+    return 0;
+}
+
+/**
+ * @fn int memory_remove(char *path)
+ * @brief Delete a file from the in-memory engine. Missing files are left alone.
+ * @param path The file path.
+ * @return 0.
+ */
+int memory_remove(char *path) {
+    memory_file **link, *file;
+
+    pthread_rwlock_wrlock(&memory_lock);
+    for (link = &memory_files[hash_path(path) % MEMORY_BUCKETS]; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) == 0) {
+            file = *link;
+            *link = file->next;
+            free(file->data);
+            free(file->path);
+            free(file);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&memory_lock);
+    return 0;
+}
+
+/**
+ * @fn int memory_exists(char *path)
+ * @brief Check whether a file exists in the in-memory engine.
+ * @param path The file path.
+ * @return Non-zero if the file exists.
+ */
+int memory_exists(char *path) {
+    int exists;
+
+    pthread_rwlock_rdlock(&memory_lock);
+    exists = memory_find(path, 0) != NULL;
+    pthread_rwlock_unlock(&memory_lock);
+    return exists;
+}
+
+/**
+ * @fn int memory_stat(char *path, size_t *size)
+ * @brief Determine the size of a file in the in-memory engine.
+ * @param path The file path.
+ * @param size Set to the size of the file.
+ * @return 0 on success, -1 if the file does not exist.
+ */
+int memory_stat(char *path, size_t *size) {
+    memory_file *file;
+
+    pthread_rwlock_rdlock(&memory_lock);
+    file = memory_find(path, 0);
+    if (file != NULL)
+        *size = file->length;
+    pthread_rwlock_unlock(&memory_lock);
+    return file == NULL ? -1 : 0;
+}
+
+/**
+ * @fn void memory_glob(char *pattern, glob_t *matches)
+ * @brief Add the files in the in-memory engine matching a glob pattern to matches,
+ *        or the pattern itself if none match.
+ * @param pattern The glob pattern.
+ * @param matches The list of matches.
+ */
+void memory_glob(char *pattern, glob_t *matches) {
+    memory_file *file;
+    size_t first = matches->gl_pathc;
+    int bucket;
+
+    pthread_rwlock_rdlock(&memory_lock);
+    for (bucket = 0; bucket < MEMORY_BUCKETS; bucket++) {
+        for (file = memory_files[bucket]; file != NULL; file = file->next) {
+            if (fnmatch(pattern, file->path, 0) != 0)
+                continue;
+            matches->gl_pathv = realloc(matches->gl_pathv, (matches->gl_pathc + 1) * sizeof(char *));
+            matches->gl_pathv[matches->gl_pathc++] = strdup(file->path);
+        }
+    }
+    pthread_rwlock_unlock(&memory_lock);
+
+    if (matches->gl_pathc == first) {
+        matches->gl_pathv = realloc(matches->gl_pathv, (matches->gl_pathc + 1) * sizeof(char *));
+        matches->gl_pathv[matches->gl_pathc++] = strdup(pattern);
+    }
+}
+
+/**
+ * @fn void memory_close()
+ * @brief Free every file in the in-memory engine.
+ */
+void memory_close() {
+    memory_file *file, *next;
+    int bucket;
+
+    for (bucket = 0; bucket < MEMORY_BUCKETS; bucket++) {
+        for (file = memory_files[bucket]; file != NULL; file = next) {
+            next = file->next;
+            free(file->data);
+            free(file->path);
+            free(file);
+        }
+    }
+}
+
+/**
+ * Storage engines available through -b. To add an engine, implement its operations
+ * (see storage_engine) and list it in engines.
+ */
+storage_engine posix_engine = {
+    "posix", NULL, NULL, posix_append, posix_read_all, posix_read_range,
+    posix_truncate, posix_remove, posix_exists, posix_stat, posix_glob, posix_sync, posix_advise
+};
+storage_engine memory_engine = {
+    "memory", NULL, memory_close, memory_append, memory_read_all, memory_read_range,
+    memory_truncate, memory_remove, memory_exists, memory_stat, memory_glob, NULL, NULL
+};
+storage_engine log_engine = {
+    "log", log_open, log_close, log_append, log_read, log_read_range,
+    log_truncate, log_remove, log_exists, log_size, log_glob, log_sync, log_advise
+};
+storage_engine *engines[] = {&posix_engine, &memory_engine, &log_engine, NULL};
+
+/**
+ * @fn storage_engine *find_engine(char *name)
+ * @brief Look up a storage engine by name.
+ * @param name The name of the engine.
+ * @return The engine, or NULL if there is none by that name.
+ */
+storage_engine *find_engine(char *name) {
+    int engine;
+
+    for (engine = 0; engines[engine] != NULL; engine++)
+        if (strcmp(engines[engine]->name, name) == 0)
+            return engines[engine];
+    return NULL;
+}
+
+/**
+ * @fn storage_engine *engine_for(char *path)
+ * @brief Determine which storage engine holds a file. The server's own files
+ *        are always regular files; user files are in the engine chosen with -b.
+ * @param path The file path.
+ * @return The storage engine.
+ */
+storage_engine *engine_for(char *path) {
+    return is_server_file(path) ? &posix_engine : storage;
+}
+
+/*****************************
+ *    Write-back buffering   *
+ *****************************/
+
+/**
+ * @fn file_t *writeback_file(char *path)
+ * @brief Look up the registry node holding a file's write-back buffer. The node of
+ *        the file of the request being handled was already looked up (see request_file).
+ * @param path The file path.
+ * @return The file's registry node.
+ */
+file_t *writeback_file(char *path) {
+    file_t *file = request_file;
+
+    if (file != NULL && strcmp(file->path, path) == 0)
+        return file;
+    ticket_lock("open_files", open_files_lock);
+    file = find_file(path);
+    ticket_unlock(open_files_lock);
+    return file;
+}
+
+/**
+ * @fn int writeback_drain(file_t *file)
+ * @brief Append a file's buffered text to the file. The caller must hold file->wb_lock.
+ * @param file The file's registry node.
+ * @return 0 on success, -1 on failure.
+ */
+int writeback_drain(file_t *file) {
+    int return_value = 0;
+
+    if (file->wb_len == 0)
+        return 0;
+    if (engine_for(file->path)->append(file->path, file->wb_data, file->wb_len) != 0) {
+        print_log(1, "writeback", "Cannot write %zu buffered bytes to \"%s\".", file->wb_len, file->path);
+        return_value = -1;
+    }
+    __sync_fetch_and_sub(&writeback_dirty, file->wb_len);
+    __sync_fetch_and_add(&stat_wb_flushes, 1);
+    file->wb_len = 0;
+    return return_value;
+}
+
+/**
+ * @fn void writeback_list(file_t *file)
+ * @brief Put a file with buffered text on the flusher's list, unless it is on it already.
+ *        The caller must hold file->wb_lock.
+ * @param file The file's registry node.
+ */
+void writeback_list(file_t *file) {
+    pthread_mutex_lock(&writeback_lock);
+    if (!file->wb_listed) {
+        file->wb_listed = 1;
+        file->wb_next = writeback_head;
+        writeback_head = file;
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/**
+ * @fn int writeback_append(char *path, char *text, size_t length)
+ * @brief Append text to a file's write-back buffer instead of the file (-f).
+ *        A buffer that would grow past WRITEBACK_FILE_MAX bytes is written out first,
+ *        and so is this file's, once the server holds more than its dirty byte limit.
+ *        The caller must hold the file's lock.
+ * @param path The file path.
+ * @param text The text to append.
+ * @param length Length of the text.
+ * @return 0 on success, -1 on failure.
+ */
+int writeback_append(char *path, char *text, size_t length) {
+    file_t *file = writeback_file(path);
+    size_t dirty;
+    int return_value = 0;
+
+    pthread_mutex_lock(&file->wb_lock);
+    if (file->wb_len + length > WRITEBACK_FILE_MAX)
+        return_value = writeback_drain(file);
+    if (length > WRITEBACK_FILE_MAX) {
+        pthread_mutex_unlock(&file->wb_lock);
+        return engine_for(path)->append(path, text, length) != 0 ? -1 : return_value;
+    }
+
+    if (file->wb_data == NULL)
+        file->wb_data = malloc(WRITEBACK_FILE_MAX);
+    if (file->wb_len == 0)
+        clock_gettime(CLOCK_MONOTONIC, &file->wb_since);
+    memcpy(file->wb_data + file->wb_len, text, length);
+    file->wb_len += length;
+    dirty = __sync_add_and_fetch(&writeback_dirty, length);
+    if (dirty > stat_wb_peak)
+        stat_wb_peak = dirty;
+    __sync_fetch_and_add(&stat_wb_appends, 1);
+
+    // Over the limit, the writer pays for its own file, and the flusher for the rest
+    if (dirty > writeback_limit) {
+        return_value = writeback_drain(file);
+        pthread_cond_signal(&writeback_ready);
+    } else {
+        writeback_list(file);
+    }
+    pthread_mutex_unlock(&file->wb_lock);
+    return return_value;
+}
+
+/**
+ * @fn void writeback_flush(char *path)
+ * @brief Write out a file's buffered text, if any, before the file is read,
+ *        emptied or synced, so that its readers see every completed write.
+ * @param path The file path.
+ */
+void writeback_flush(char *path) {
+    file_t *file;
+
+    if (writeback_limit == 0 || is_server_file(path))
+        return;
+    file = writeback_file(path);
+    pthread_mutex_lock(&file->wb_lock);
+    writeback_drain(file);
+    pthread_mutex_unlock(&file->wb_lock);
+}
+
+/**
+ * @fn void writeback_pass(int force)
+ * @brief Write out the buffers that have been dirty for WRITEBACK_INTERVAL_US or more,
+ *        or every buffer if force is non-zero or the server is over its dirty byte limit.
+ *        Buffers that are kept stay on the flusher's list.
+ * @param force Set to a non-zero value to write out every buffer.
+ */
+void writeback_pass(int force) {
+    file_t *file, *next;
+
+    pthread_mutex_lock(&writeback_lock);
+    file = writeback_head;
+    writeback_head = NULL;
+    for (next = file; next != NULL; next = next->wb_next)
+        next->wb_listed = 0;
+    pthread_mutex_unlock(&writeback_lock);
+
+    for (; file != NULL; file = next) {
+        next = file->wb_next;
+        pthread_mutex_lock(&file->wb_lock);
+        if (force || writeback_dirty > writeback_limit ||
+            elapsed_since(&file->wb_since) * 1000000 >= WRITEBACK_INTERVAL_US)
+            writeback_drain(file);
+        if (file->wb_len > 0)
+            writeback_list(file);
+        pthread_mutex_unlock(&file->wb_lock);
+    }
+}
+
+/**
+ * @fn void *writeback_thread(void *arg)
+ * @brief Flusher thread of write-back buffering (-f). Writes out buffers as they age,
+ *        or as soon as the server goes over its dirty byte limit, and all of them on exit.
+ * @param arg Unused.
+ */
+void *writeback_thread(void *arg) {
+    struct timespec deadline;
+    int closed;
+
+    do {
+        pthread_mutex_lock(&writeback_lock);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WRITEBACK_INTERVAL_US / 2 * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (!writeback_closed)
+            pthread_cond_timedwait(&writeback_ready, &writeback_lock, &deadline);
+        closed = writeback_closed;
+        pthread_mutex_unlock(&writeback_lock);
+        writeback_pass(closed);
+    } while (!closed);
+    return NULL;
+}
+
+/*****************************
+ *      Output segments      *
+ *****************************/
+
+/**
+ * @fn output_log *output_for(char *path)
+ * @brief Find the segments of one of the server's own files.
+ * @param path The file path.
+ * @return The file's output_log, or NULL if it is not one of the server's files.
+ */
+output_log *output_for(char *path) {
+    int index;
+
+    for (index = 0; index < 3; index++)
+        if (strcmp(outputs[index].path, path) == 0)
+            return &outputs[index];
+    return NULL;
+}
+
+/**
+ * @fn char *segment_path(output_log *log, unsigned long number)
+ * @brief Build the path of a segment: <path>.<number> for sealed ones,
+ *        and the file's own path for the active one.
+ * @param log output_log of the file.
+ * @param number The segment number.
+ * @return The path, to be freed by the caller.
+ */
+char *segment_path(output_log *log, unsigned long number) {
+    char *path = malloc(strlen(log->path) + 24);
+
+    if (number == log->active)
+        strcpy(path, log->path);
+    else
+        sprintf(path, "%s.%lu", log->path, number);
+    return path;
+}
+
+/**
+ * @fn void output_save(output_log *log)
+ * @brief Write the manifest of a file's segments, one line per segment:
+ *            segment <number> <first seq> <last seq> <size in bytes>
+ *            active <number> <first seq>
+ *        The manifest is written next to the old one and renamed over it.
+ * @param log output_log of the file.
+ */
+void output_save(output_log *log) {
+    char *manifest_path = malloc(strlen(log->path) + 16), *tmp_path = malloc(strlen(log->path) + 16);
+    FILE *manifest;
+    int index;
+
+    sprintf(manifest_path, "%s.segments", log->path);
+    sprintf(tmp_path, "%s.segments.tmp", log->path);
+    manifest = fopen(tmp_path, "w");
+    if (manifest == NULL) {
+        print_log(1, "output_save", "Cannot open \"%s\" for writing.", tmp_path);
+    } else {
+        for (index = 0; index < log->sealed_count; index++)
+            fprintf(manifest, "segment %lu %lu %lu %zu\n", log->sealed[index].number,
+                    log->sealed[index].first_seq, log->sealed[index].last_seq, log->sealed[index].size);
+        fprintf(manifest, "active %lu %lu\n", log->active, log->first_seq);
+        if (fclose(manifest) != 0 || rename(tmp_path, manifest_path) != 0)
+            print_log(1, "output_save", "Cannot write \"%s\": %s", manifest_path, strerror(errno));
+    }
+    free(manifest_path);
+    free(tmp_path);
+}
+
+/**
+ * @fn void output_init()
+ * @brief Read the manifests of the server's own files, left by this or an earlier run
+ *        with segment rotation (-o). Files without a manifest start out with segment 1 active.
+ */
+void output_init() {
+    output_log *log;
+    segment_t segment;
+    char path[64], line[128];
+    FILE *manifest;
+    int index;
+
+    for (index = 0; index < 3; index++) {
+        log = &outputs[index];
+        log->active = 1;
+        log->index_fd = -1;
+        sprintf(path, "%s.segments", log->path);
+        manifest = fopen(path, "r");
+        if (manifest == NULL)
+            continue;
+        while (fgets(line, sizeof(line), manifest) != NULL) {
+            if (sscanf(line, "segment %lu %lu %lu %zu", &segment.number, &segment.first_seq,
+                       &segment.last_seq, &segment.size) == 4 && log->sealed_count < SEGMENTS_MAX) {
+                log->sealed = realloc(log->sealed, (log->sealed_count + 1) * sizeof(segment_t));
+                log->sealed[log->sealed_count++] = segment;
+            } else if (sscanf(line, "active %lu %lu", &log->active, &log->first_seq) == 2) {
+                log->last_seq = log->first_seq;
+            }
+        }
+        fclose(manifest);
+        log->opened = time(NULL);
+    }
+
+    // Request numbers only count across runs with crash recovery, so the index of
+    // an earlier run is only of use then
+    for (index = 0; response_index && index < 2; index++) {
+        log = &outputs[index];
+        sprintf(path, "%s.idx", log->path);
+        log->index_fd = open(path, O_RDWR | O_CREAT | (checkpoint_every ? 0 : O_TRUNC), 0666);
+        if (log->index_fd < 0)
+            print_log(1, "output_init", "Cannot open \"%s\": %s", path, strerror(errno));
+    }
+}
+
+/**
+ * @fn int output_rotate(output_log *log)
+ * @brief Seal the active segment of a file once it reaches the size (-o) or age limit,
+ *        by renaming it to <path>.<number>, so that the next record starts a new one.
+ *        With pruning, the oldest sealed segments beyond the number to keep are deleted.
+ *        Empty segments are never sealed. The caller must hold the file's lock.
+ * @param log output_log of the file.
+ * @return Non-zero if the segment was sealed.
+ */
+int output_rotate(output_log *log) {
+    segment_t segment = {log->active, log->first_seq, log->last_seq, 0};
+    char *sealed_path;
+    int pruned = 0;
+
+    if (log->first_seq == 0 || (rotate_size == 0 && rotate_age == 0))
+        return 0;
+    posix_stat(log->path, &segment.size);
+    if ((rotate_size == 0 || segment.size < rotate_size) &&
+        (rotate_age == 0 || time(NULL) - log->opened < rotate_age))
+        return 0;
+
+    // Requests sync the files they changed by path, so sync the segment before it moves
+    if (durability != DURABILITY_NONE)
+        posix_sync(log->path);
+    sealed_path = malloc(strlen(log->path) + 24);
+    sprintf(sealed_path, "%s.%lu", log->path, log->active);
+    if (rename(log->path, sealed_path) != 0) {
+        print_log(1, "output_rotate", "Cannot seal \"%s\": %s", log->path, strerror(errno));
+        free(sealed_path);
+        return 0;
+    }
+    print_log(0, "output_rotate", "Sealed \"%s\" as \"%s\".", log->path, sealed_path);
+    if (log->sealed_count == SEGMENTS_MAX)
+        memmove(log->sealed, log->sealed + 1, --log->sealed_count * sizeof(segment_t));
+    log->sealed = realloc(log->sealed, (log->sealed_count + 1) * sizeof(segment_t));
+    log->sealed[log->sealed_count++] = segment;
+    log->active++;
+    log->first_seq = log->last_seq = 0;
+    log->opened = time(NULL);
+    __sync_fetch_and_add(&stat_rotations, 1);
+
+    // Prune the oldest segments
+    while (rotate_keep > 0 && log->sealed_count - pruned > rotate_keep) {
+        sprintf(sealed_path, "%s.%lu", log->path, log->sealed[pruned].number);
+        if (unlink(sealed_path) != 0 && errno != ENOENT)
+            print_log(1, "output_rotate", "Cannot prune \"%s\": %s", sealed_path, strerror(errno));
+        pruned++;
+    }
+    if (pruned > 0) {
+        log->sealed_count -= pruned;
+        memmove(log->sealed, log->sealed + pruned, log->sealed_count * sizeof(segment_t));
+        __sync_fetch_and_add(&stat_pruned, pruned);
+    }
+    output_save(log);
+    free(sealed_path);
+    return 1;
+}
+
+/**
+ * @fn void output_rewind(output_log *log, unsigned long number, size_t size)
+ * @brief Bring a file back to the given segment and size, as of a checkpoint (see -k).
+ *        Segments sealed since then are undone: the segments after the given one only
+ *        hold records of requests after the checkpoint, which are replayed, so they are
+ *        deleted, and the given segment becomes the active one again.
+ * @param log output_log of the file.
+ * @param number Number of the segment that was active at the checkpoint.
+ * @param size Size of that segment at the checkpoint.
+ */
+void output_rewind(output_log *log, unsigned long number, size_t size) {
+    char *path;
+    int index;
+
+    if (number < log->active) {
+        while (log->active > number + 1) {
+            path = segment_path(log, --log->active);
+            unlink(path);
+            free(path);
+        }
+        path = segment_path(log, number);
+        if (rename(path, log->path) != 0)
+            print_log(1, "recovery", "Cannot restore \"%s\" from \"%s\": %s", log->path, path, strerror(errno));
+        free(path);
+        log->active = number;
+        for (index = 0; index < log->sealed_count && log->sealed[index].number < number; index++)
+            ;
+        log->first_seq = index < log->sealed_count ? log->sealed[index].first_seq : 0;
+        log->sealed_count = index;
+        output_save(log);
+    }
+    if (truncate(log->path, size) != 0 && errno != ENOENT)
+        print_log(1, "recovery", "Cannot restore \"%s\": %s", log->path, strerror(errno));
+}
+
+/**
+ * @fn off_t output_offset(char *path)
+ * @brief Find where the next record of one of the server's own files will start,
+ *        for its response index (see -x). The caller must hold the file's lock.
+ * @param path The file path.
+ * @return The size of the file's active segment, or -1 if the file is not indexed.
+ */
+off_t output_offset(char *path) {
+    output_log *log = output_for(path);
+    size_t size = 0;
+
+    if (log == NULL || log->index_fd < 0)
+        return -1;
+    posix_stat(path, &size);
+    return size;
+}
+
+/**
+ * @fn void output_appended(char *path, unsigned long seq, off_t offset)
+ * @brief Note that a record of a request was appended to one of the server's own files.
+ *        With a response index (-x), the record is indexed; with segment rotation (-o),
+ *        the active segment is sealed if it is due. With crash recovery (-k), segments
+ *        are only sealed at checkpoints (see write_checkpoint()).
+ *        The caller must hold the file's lock.
+ * @param path The file path.
+ * @param seq The request number.
+ * @param offset Where the record starts, from output_offset() before it was appended.
+ */
+void output_appended(char *path, unsigned long seq, off_t offset) {
+    output_log *log = output_for(path);
+    index_entry entry;
+    size_t size = 0;
+
+    if (log == NULL)
+        return;
+    if (log->index_fd >= 0 && offset >= 0 && posix_stat(path, &size) == 0) {
+        entry.seq = seq;
+        entry.segment = log->active;
+        entry.offset = offset;
+        entry.length = size - offset;
+        if (pwrite(log->index_fd, &entry, sizeof(entry), (off_t)seq * sizeof(entry)) != sizeof(entry))
+            print_log(1, "output_appended", "Cannot index request #%lu in \"%s\": %s", seq, path, strerror(errno));
+    }
+    if (rotate_size == 0 && rotate_age == 0)
+        return;
+    if (log->first_seq == 0) {
+        log->first_seq = seq;
+        log->opened = time(NULL);
+        output_save(log);
+    }
+    if (seq > log->last_seq)
+        log->last_seq = seq;
+    if (checkpoint_every == 0)
+        output_rotate(log);
+}
+
+/**
+ * @fn char *lookup_response(char *path, unsigned long seq, size_t *length)
+ * @brief Look up the record of a request in <READ_FILE> or <EMPTY_FILE> by its number,
+ *        using the file's response index (see -x), with one read of the index and one
+ *        of the record. Can be used while the server is running.
+ * @param path <READ_FILE> or <EMPTY_FILE>.
+ * @param seq The request number.
+ * @param length Set to the length of the record.
+ * @return The record, to be freed by the caller, or NULL if it is not in the index
+ *         or its segment has been pruned.
+ */
+char *lookup_response(char *path, unsigned long seq, size_t *length) {
+    char *index_path = malloc(strlen(path) + 24), *record = NULL, line[128];
+    unsigned long active = 1;
+    index_entry entry;
+    FILE *manifest;
+    int fd;
+
+    // The active segment is at the file's own path, and sealed ones at <path>.<number>
+    sprintf(index_path, "%s.segments", path);
+    if ((manifest = fopen(index_path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), manifest) != NULL)
+            sscanf(line, "active %lu", &active);
+        fclose(manifest);
+    }
+
+    sprintf(index_path, "%s.idx", path);
+    fd = open(index_path, O_RDONLY);
+    if (fd < 0 || pread(fd, &entry, sizeof(entry), (off_t)seq * sizeof(entry)) != sizeof(entry) || entry.seq != seq)
+        goto cleanup;
+    close(fd);
+
+    if (entry.segment == active)
+        strcpy(index_path, path);
+    else
+        sprintf(index_path, "%s.%lu", path, (unsigned long)entry.segment);
+    fd = open(index_path, O_RDONLY);
+    if (fd < 0)
+        goto cleanup;
+    record = malloc(entry.length + 1);
+    if (pread(fd, record, entry.length, entry.offset) != (ssize_t)entry.length) {
+        free(record);
+        record = NULL;
+        goto cleanup;
+    }
+    record[entry.length] = '\0';
+    *length = entry.length;
+
+cleanup:
+    if (fd >= 0)
+        close(fd);
+    free(index_path);
+    return record;
+}
+
+/*****************************
+ *         Durability        *
+ *****************************/
+
+/**
+ * @fn void mark_dirty(char *path)
+ * @brief Note that the current request changed a file, so that it is synced before
+ *        the request completes (see commit_request()). Does nothing without -d.
+ * @param path The file path. It must stay valid until the request is committed.
+ */
+void mark_dirty(char *path) {
+    int index;
+
+    if (durability == DURABILITY_NONE)
+        return;
+    for (index = 0; index < dirtied_count; index++)
+        if (strcmp(dirtied[index], path) == 0)
+            return;
+    if (dirtied_count == 0 && durability == DURABILITY_GROUP)
+        __sync_fetch_and_add(&sync_active, 1);
+    if (dirtied_count < DIRTIED_MAX)
+        dirtied[dirtied_count++] = path;
+}
+
+/**
+ * @fn void sync_path(char *path)
+ * @brief Sync a file with the engine that stores it, logging failures.
+ *        Text still in its write-back buffer is written out first.
+ * @param path The file path.
+ */
+void sync_path(char *path) {
+    storage_engine *engine = engine_for(path);
+
+    writeback_flush(path);
+    if (engine->sync != NULL && engine->sync(path) != 0)
+        print_log(1, "sync", "Cannot sync \"%s\" (%s).", path, strerror(errno));
+}
+
+/**
+ * @fn void commit_request()
+ * @brief Make the files changed by the current request durable before it completes.
+ *        With DURABILITY_CLOSE, each file is synced right away. With DURABILITY_GROUP,
+ *        the files join the next batch of the sync thread, and we wait for that batch.
+ */
+void commit_request() {
+    struct timespec start;
+    unsigned long batch;
+    double latency;
+    int index, pending;
+
+    if (dirtied_count == 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (durability == DURABILITY_CLOSE) {
+        for (index = 0; index < dirtied_count; index++)
+            sync_path(dirtied[index]);
+        pthread_mutex_lock(&sync_lock);
+        stat_sync_batches++;
+        stat_sync_files += dirtied_count;
+    } else {
+        pthread_mutex_lock(&sync_lock);
+        for (index = 0; index < dirtied_count; index++) {
+            for (pending = 0; pending < sync_count; pending++)
+                if (strcmp(sync_paths[pending], dirtied[index]) == 0)
+                    break;
+            if (pending < sync_count)
+                continue;
+            if (sync_count == sync_size) {
+                sync_size = sync_size == 0 ? 16 : sync_size * 2;
+                sync_paths = realloc(sync_paths, sync_size * sizeof(char *));
+            }
+            sync_paths[sync_count++] = strdup(dirtied[index]);
+        }
+        batch = sync_batch;
+        sync_waiting++;
+        __sync_fetch_and_sub(&sync_active, 1);
+        pthread_cond_signal(&sync_ready);
+        while (sync_done < batch)
+            pthread_cond_wait(&sync_finished, &sync_lock);
+    }
+
+    latency = elapsed_since(&start);
+    stat_sync_requests++;
+    stat_sync_latency += latency;
+    if (latency > stat_sync_latency_max)
+        stat_sync_latency_max = latency;
+    pthread_mutex_unlock(&sync_lock);
+    dirtied_count = 0;
+}
+
+/**
+ * @fn void *sync_thread(void *arg)
+ * @brief Sync thread of group commit mode (-d group). Once a request hands it files,
+ *        it waits up to GROUP_COMMIT_US microseconds for the other requests that changed
+ *        files to join, then syncs them all at once and wakes up every request of the batch.
+ *        A request running alone is synced right away.
+ * @param arg Unused.
+ */
+void *sync_thread(void *arg) {
+    struct timespec deadline;
+    char **paths;
+    int count, index;
+
+    pthread_mutex_lock(&sync_lock);
+    while (1) {
+        while (sync_waiting == 0 && !sync_closed)
+            pthread_cond_wait(&sync_ready, &sync_lock);
+        if (sync_waiting == 0)
+            break;
+
+        // Let more requests join the batch
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += GROUP_COMMIT_US * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (sync_active > 0 && !sync_closed &&
+               pthread_cond_timedwait(&sync_ready, &sync_lock, &deadline) == 0);
+
+        // Take the batch; later requests join the next one
+        paths = sync_paths;
+        count = sync_count;
+        sync_paths = NULL;
+        sync_count = sync_size = 0;
+        sync_waiting = 0;
+        sync_batch++;
+        pthread_mutex_unlock(&sync_lock);
+
+        for (index = 0; index < count; index++) {
+            sync_path(paths[index]);
+            free(paths[index]);
+        }
+        free(paths);
+
+        pthread_mutex_lock(&sync_lock);
+        sync_done = sync_batch - 1;
+        stat_sync_batches++;
+        stat_sync_files += count;
+        pthread_cond_broadcast(&sync_finished);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return NULL;
+}
+
+/*****************************
+ *       Crash recovery      *
+ *****************************/
+
+/**
+ * @fn void journal_request(thread_parcel *parcel, char *cmdline)
+ * @brief Append a command line to <COMMANDS_FILE>, along with the current timestamp.
+ *        With crash recovery (-k), the request is also journaled until it is applied,
+ *        except for cancellations, which are not replayed.
+ * @param parcel thread_parcel of the request, with its seq and cmdline set.
+ * @param cmdline The full command line, as received.
+ */
+void journal_request(thread_parcel *parcel, char *cmdline) {
+    char *timestamp = get_time(), *log_line;
+
+    log_line = malloc(strlen(timestamp) + strlen(cmdline) + 5);
+    sprintf(log_line, "[%s] %s\n", timestamp, cmdline);
+    if (checkpoint_every == 0) {
+        posix_append(COMMANDS_FILE, log_line, strlen(log_line));
+        output_appended(COMMANDS_FILE, parcel->seq, -1);
+        free(log_line);
+        return;
+    }
+
+    // Journal the request in the same critical section as its line, so that
+    // checkpoints see it as journaled as soon as it is in the file
+    pthread_mutex_lock(&journal_lock);
+    posix_append(COMMANDS_FILE, log_line, strlen(log_line));
+    output_appended(COMMANDS_FILE, parcel->seq, -1);
+    parcel->journal_offset = journal_size;
+    journal_size += strlen(log_line);
+    journal_seq = parcel->seq;
+    if (strncmp(parcel->cmdline, "cancel ", 7) != 0) {
+        parcel->journaled = 1;
+        parcel->journal_prev = journal_tail;
+        if (journal_tail != NULL)
+            journal_tail->journal_next = parcel;
+        else
+            journal_head = parcel;
+        journal_tail = parcel;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    free(log_line);
+}
+
+/**
+ * @fn void journal_unlink(thread_parcel *parcel)
+ * @brief Remove a request from the journal, once it is applied or turned away.
+ * @param parcel thread_parcel of the request.
+ */
+void journal_unlink(thread_parcel *parcel) {
+    if (!parcel->journaled)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    if (parcel->journal_prev != NULL)
+        parcel->journal_prev->journal_next = parcel->journal_next;
+    else
+        journal_head = parcel->journal_next;
+    if (parcel->journal_next != NULL)
+        parcel->journal_next->journal_prev = parcel->journal_prev;
+    else
+        journal_tail = parcel->journal_prev;
+    parcel->journaled = 0;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * @fn void apply_begin()
+ * @brief Start applying a request, holding off checkpoints until apply_end().
+ *        Calls nest, e.g. when an empty reports its status from within its handler.
+ *        With a durability level (-d), the request's journal line is synced along
+ *        with its files, so that a request that completed is never lost on recovery.
+ */
+void apply_begin() {
+    if (checkpoint_every == 0 || applying++ > 0)
+        return;
+    pthread_rwlock_rdlock(&apply_lock);
+    mark_dirty(COMMANDS_FILE);
+}
+
+/**
+ * @fn void apply_end(thread_parcel *parcel)
+ * @brief Finish applying a request: record it as its file's last applied request,
+ *        remove it from the journal, and have a checkpoint written every
+ *        <checkpoint_every> requests.
+ * @param parcel thread_parcel of the request.
+ */
+void apply_end(thread_parcel *parcel) {
+    file_t *file;
+
+    if (checkpoint_every == 0 || --applying > 0)
+        return;
+
+    // A single-file request holds its file's lock, and its node was looked up already
+    if (parcel->path != NULL && parcel->sources == NULL && parcel->file != NULL) {
+        if (parcel->seq > parcel->file->applied_seq)
+            parcel->file->applied_seq = parcel->seq;
+    } else if (parcel->path != NULL) {
+        ticket_lock("open_files", open_files_lock);
+        file = find_file(parcel->path);
+        if (parcel->seq > file->applied_seq)
+            file->applied_seq = parcel->seq;
+        ticket_unlock(open_files_lock);
+    }
+    journal_unlink(parcel);
+    pthread_rwlock_unlock(&apply_lock);
+
+    pthread_mutex_lock(&journal_lock);
+    if (++applied_count % checkpoint_every == 0) {
+        checkpoint_due = 1;
+        pthread_cond_signal(&checkpoint_ready);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * @fn void save_undo(char *path)
+ * @brief Save the contents of a file before it is first changed after a checkpoint,
+ *        so that recovery can restore it. The file is listed in UNDO_DIR/undo, along
+ *        with the checkpoint generation and its undo image, or "-" if it does not exist.
+ *        The caller must hold the file's lock, and be applying a request.
+ * @param path The file path.
+ */
+void save_undo(char *path) {
+    file_t *file;
+    FILE *image, *list;
+    char image_path[64], *contents;
+    size_t length;
+    int first;
+
+    if (checkpoint_every == 0)
+        return;
+
+    ticket_lock("open_files", open_files_lock);
+    file = find_file(path);
+    first = file->undo_gen != checkpoint_gen;
+    file->undo_gen = checkpoint_gen;
+    ticket_unlock(open_files_lock);
+    if (!first)
+        return;
+
+    contents = engine_for(path)->read_all(path, &length);
+    pthread_mutex_lock(&undo_lock);
+    strcpy(image_path, "-");
+    if (contents != NULL) {
+        sprintf(image_path, "%s/%lu-%d.img", UNDO_DIR, checkpoint_gen, undo_count++);
+        image = fopen(image_path, "w");
+        if (image == NULL || fwrite(contents, 1, length, image) != length)
+            print_log(1, "save_undo", "Cannot save undo image of \"%s\".", path);
+        if (image != NULL && durability != DURABILITY_NONE && fflush(image) == 0)
+            fdatasync(fileno(image));
+        if (image != NULL)
+            fclose(image);
+    }
+    list = fopen(UNDO_DIR "/undo", "a");
+    if (list != NULL) {
+        fprintf(list, "%lu %s %s\n", checkpoint_gen, image_path, path);
+        if (durability != DURABILITY_NONE && fflush(list) == 0)
+            fdatasync(fileno(list));
+        fclose(list);
+    }
+    pthread_mutex_unlock(&undo_lock);
+    free(contents);
+}
+
+/**
+ * @fn void save_outcome(thread_parcel *parcel, char *status)
+ * @brief Record that a request was turned away with a status instead of being applied.
+ *        The request is listed in UNDO_DIR/outcomes with its status until the next
+ *        checkpoint, and is not redone by recovery. The caller must be applying the request.
+ * @param parcel thread_parcel of the request.
+ * @param status The status, e.g. "TIMED OUT".
+ */
+void save_outcome(thread_parcel *parcel, char *status) {
+    FILE *list;
+
+    if (checkpoint_every == 0)
+        return;
+
+    pthread_mutex_lock(&undo_lock);
+    list = fopen(UNDO_DIR "/outcomes", "a");
+    if (list != NULL) {
+        fprintf(list, "%lu %s\n", parcel->seq, status);
+        if (durability != DURABILITY_NONE && fflush(list) == 0)
+            fdatasync(fileno(list));
+        fclose(list);
+    } else {
+        print_log(1, "save_outcome", "Cannot record the status of request #%lu.", parcel->seq);
+    }
+    pthread_mutex_unlock(&undo_lock);
+}
+
+/**
+ * @fn void clear_undo()
+ * @brief Delete every undo image, once no checkpoint needs them anymore.
+ */
+void clear_undo() {
+    DIR *dir = opendir(UNDO_DIR);
+    struct dirent *dirent;
+    char path[300];
+
+    if (dir == NULL)
+        return;
+    while ((dirent = readdir(dir)) != NULL) {
+        if (dirent->d_name[0] == '.')
+            continue;
+        sprintf(path, "%s/%s", UNDO_DIR, dirent->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    undo_count = 0;
+}
+
+/**
+ * @fn int write_checkpoint()
+ * @brief Write a checkpoint of the requests applied so far to <CHECKPOINT_FILE>:
+ *            checkpoint <generation> <last seq> <journal offset> <first seq> <read size> <empty size>
+ *                       <read segment> <empty segment> <journal segment>
+ *            pending <seq>              (for each journaled request)
+ *            applied <seq> <path>       (for each user file)
+ *        Replay starts at the journal offset in the journal segment, the line of <first seq>,
+ *        and redoes the requests still pending and those after <last seq>. <READ_FILE> and
+ *        <EMPTY_FILE> only ever grow, so they are restored by cutting their segments back
+ *        to their sizes. With segment rotation (-o), segments that are due are sealed first,
+ *        <COMMANDS_FILE> only while no request is journaled.
+ *        The checkpoint is written next to the old one and renamed over it, after which
+ *        the undo images of the old one are deleted. Write-back buffers (-f) are
+ *        written out first, so that the files hold every applied request.
+ * @return 0 on success, -1 on failure.
+ */
+int write_checkpoint() {
+    thread_parcel *parcel;
+    file_t *file;
+    FILE *manifest;
+    size_t read_size = 0, empty_size = 0;
+    int bucket, return_value = 0;
+
+    pthread_rwlock_wrlock(&apply_lock);
+    if (writeback_limit > 0)
+        writeback_pass(1);
+    manifest = fopen(CHECKPOINT_FILE ".tmp", "w");
+    if (manifest == NULL) {
+        print_log(1, "checkpoint", "Cannot open \"%s\" for writing.", CHECKPOINT_FILE ".tmp");
+        pthread_rwlock_unlock(&apply_lock);
+        return -1;
+    }
+    output_rotate(output_for(READ_FILE));
+    output_rotate(output_for(EMPTY_FILE));
+    posix_stat(READ_FILE, &read_size);
+    posix_stat(EMPTY_FILE, &empty_size);
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_head == NULL && output_rotate(output_for(COMMANDS_FILE)))
+        journal_size = 0;
+    fprintf(manifest, "checkpoint %lu %lu %lld %lu %zu %zu %lu %lu %lu\n", checkpoint_gen + 1, journal_seq,
+            (long long)(journal_head != NULL ? journal_head->journal_offset : journal_size),
+            journal_head != NULL ? journal_head->seq : journal_seq + 1, read_size, empty_size,
+            outputs[0].active, outputs[1].active, outputs[2].active);
+    for (parcel = journal_head; parcel != NULL; parcel = parcel->journal_next)
+        fprintf(manifest, "pending %lu\n", parcel->seq);
+    pthread_mutex_unlock(&journal_lock);
+
+    ticket_lock("open_files", open_files_lock);
+    for (bucket = 0; bucket < REGISTRY_BUCKETS; bucket++)
+        for (file = open_files[bucket]; file != NULL; file = file->next)
+            if (file->applied_seq > 0 && !is_server_file(file->path))
+                fprintf(manifest, "applied %lu %s\n", file->applied_seq, file->path);
+    ticket_unlock(open_files_lock);
+
+    // With a durability level, the journal and the manifest must be on disk
+    // before the manifest replaces the previous one
+    if (durability != DURABILITY_NONE) {
+        posix_sync(COMMANDS_FILE);
+        if (fflush(manifest) == 0)
+            fdatasync(fileno(manifest));
+    }
+    if (fclose(manifest) != 0 || rename(CHECKPOINT_FILE ".tmp", CHECKPOINT_FILE) != 0) {
+        print_log(1, "checkpoint", "Cannot write \"%s\": %s", CHECKPOINT_FILE, strerror(errno));
+        return_value = -1;
+    } else {
+        checkpoint_gen++;
+        clear_undo();
+        __sync_fetch_and_add(&stat_checkpoints, 1);
+        print_log(0, "checkpoint", "Checkpoint %lu written at request #%lu.", checkpoint_gen, journal_seq);
+    }
+    pthread_rwlock_unlock(&apply_lock);
+    return return_value;
+}
+
+/**
+ * @fn void *checkpoint_thread(void *arg)
+ * @brief Write a checkpoint whenever apply_end() asks for one, until checkpoint_closed is set.
+ * @param arg Unused.
+ */
+void *checkpoint_thread(void *arg) {
+    pthread_mutex_lock(&journal_lock);
+    while (1) {
+        while (!checkpoint_due && !checkpoint_closed)
+            pthread_cond_wait(&checkpoint_ready, &journal_lock);
+        if (checkpoint_closed)
+            break;
+        checkpoint_due = 0;
+        pthread_mutex_unlock(&journal_lock);
+        write_checkpoint();
+        pthread_mutex_lock(&journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+/**
+ * @fn void restore_undo(unsigned long gen)
+ * @brief Restore every file changed after a checkpoint from its undo image,
+ *        or delete it if it did not exist at the time.
+ * @param gen Generation of the checkpoint.
+ */
+void restore_undo(unsigned long gen) {
+    FILE *list = fopen(UNDO_DIR "/undo", "r");
+    char image_path[64], path[109], *contents;
+    unsigned long image_gen;
+    size_t length;
+
+    if (list == NULL)
+        return;
+    while (fscanf(list, "%lu %63s %108s", &image_gen, image_path, path) == 3) {
+        if (image_gen != gen)
+            continue;
+        print_log(1, "recovery", "Restoring \"%s\" as of the checkpoint.", path);
+        engine_for(path)->remove(path);
+        if (strcmp(image_path, "-") == 0)
+            continue;
+        contents = posix_read_all(image_path, &length);
+        if (contents == NULL || engine_for(path)->append(path, contents, length) != 0)
+            print_log(1, "recovery", "Cannot restore \"%s\" from \"%s\".", path, image_path);
+        free(contents);
+    }
+    fclose(list);
+}
+
+/*****************************
+ *      Command handlers     *
+ *****************************/
+
+/**
+ * @fn int write_file(char *file_path, char *text, int for_user)
+ * @brief Write text to a file located at *file_path.
+ *        If the file already exists, append text to it.
+ *        If the file does not exist, create it and write text to it.
+ *        If for_user is non-zero, we sleep for 25ms * number of characters in text.
+ * 
+ * @param file_path Path to the file, consisting of at most 50 characters.
+ * @param text Text to write to the file.
+ * @param for_user Set to a non-zero value if we are writing to a user-specified file.
+ * @return 0 on success, -1 on failure.
+ */
+int write_file(char *file_path, char *text, int for_user) {
+    int wait_us = 25000;
+
+    // Append the text to the file, or to its write-back buffer
+    if (for_user && writeback_limit > 0) {
+        if (writeback_append(file_path, text, strlen(text)) != 0)
+            return -1;
+    } else if (engine_for(file_path)->append(file_path, text, strlen(text)) != 0)
+        return -1;
+    mark_dirty(file_path);
+
+    // Project requirement: Wait 25ms per character written
+    if (for_user && skip_sleep == 0) {
+        wait_us *= strlen(text);
+        print_log(0, "write_file", "%d characters written to \"%s\". Sleeping for %d ms...", strlen(text), file_path, wait_us / 1000);
+        spec_sleep(wait_us);
+    } else {
+        print_log(0, "write_file", "%d characters written to \"%s\".", strlen(text), file_path);
+    }
+    return 0;
+}
+
+/**
+ * @fn void mmap_fault(int sig)
+ * @brief SIGBUS handler. A fault inside mmap_copy() means the mapped source was truncated
+ *        by something outside the server, so jump back into mmap_copy(). Any other
+ *        SIGBUS is a real fault, and is raised again with the default action.
+ * @param sig The signal number.
+ */
+void mmap_fault(int sig) {
+    if (mmap_jump != NULL)
+        siglongjmp(*mmap_jump, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * @fn ssize_t mmap_copy(char *src_path, FILE *dest)
+ * @brief Append the contents of a large regular file to dest straight from a mapping
+ *        of it, in chunks of MMAP_CHUNK bytes. If the file is truncated meanwhile,
+ *        write() stops at the new end with EFAULT, and SIGBUS is caught by mmap_fault();
+ *        either way, the contents up to the truncation are appended.
+ * @param src_path The file path.
+ * @param dest The destination file, open for appending.
+ * @return Number of bytes appended, or -1 if the file cannot be mapped,
+ *         in which case nothing was appended.
+ */
+ssize_t mmap_copy(char *src_path, FILE *dest) {
+    sigjmp_buf jump;
+    struct stat src_stat;
+    char *map;
+    volatile size_t offset = 0;
+    ssize_t written;
+    int fd;
+
+    fd = open(src_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &src_stat) != 0 || src_stat.st_size == 0 ||
+        (map = mmap(NULL, src_stat.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    madvise(map, src_stat.st_size, MADV_SEQUENTIAL);
+
+    // Write around stdio, so that a jump out of a write leaves no stdio lock held
+    fflush(dest);
+    if (sigsetjmp(jump, 1) == 0) {
+        mmap_jump = &jump;
+        while (offset < (size_t)src_stat.st_size) {
+            written = write(fileno(dest), map + offset,
+                            src_stat.st_size - offset < MMAP_CHUNK ? src_stat.st_size - offset : MMAP_CHUNK);
+            if (written <= 0)
+                break;
+            offset += written;
+        }
+    }
+    mmap_jump = NULL;
+    if (offset < (size_t)src_stat.st_size) {
+        print_log(1, "read_file", "File \"%s\" was cut short at %zu bytes while being read.", src_path, (size_t)offset);
+        __sync_fetch_and_add(&stat_mmap_truncated, 1);
+    }
+    munmap(map, src_stat.st_size);
+    __sync_fetch_and_add(&stat_mmap_reads, 1);
+    return offset;
+}
+
+/**
+ * @fn ssize_t direct_write(int fd, char *buf, size_t length, off_t offset)
+ * @brief Write a block of whole DIRECT_ALIGN units to a file opened with O_DIRECT.
+ *        If the filesystem rejects the direct write, O_DIRECT is turned off
+ *        on the descriptor and the block is written through the page cache instead.
+ * @param fd The file descriptor.
+ * @param buf The data, aligned to DIRECT_ALIGN.
+ * @param length Number of bytes to write, a multiple of DIRECT_ALIGN.
+ * @param offset Offset in the file to write at, a multiple of DIRECT_ALIGN.
+ * @return 0 on success, -1 on failure.
+ */
+int direct_write(int fd, char *buf, size_t length, off_t offset) {
+    ssize_t written;
+
+    while (length > 0) {
+        written = pwrite(fd, buf, length, offset);
+        if (written < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            __sync_fetch_and_add(&stat_direct_fallbacks, 1);
+            continue;
+        }
+        if (written <= 0)
+            return -1;
+        buf += written;
+        length -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+/**
+ * @fn ssize_t direct_copy(char *src_path, char *dest_path, FILE *dest, size_t size)
+ * @brief Append the first size bytes of a large regular file to dest with O_DIRECT,
+ *        so that neither file's data goes through the page cache. Both files are
+ *        transferred in aligned blocks through leased pool buffers. The partial block
+ *        at the end of dest is read back and rewritten along with the first block
+ *        of the source, and the unaligned tail of the source is appended to dest
+ *        through the page cache. The caller must hold the lock on dest.
+ * @param src_path The file path.
+ * @param dest_path Path to the destination file.
+ * @param dest The destination file, open for appending.
+ * @param size Number of bytes to copy.
+ * @return Number of bytes appended, which is less than size if the source is short or a
+ *         write fails, or -1 if nothing was appended. Dest is cut back to the bytes
+ *         appended in full, so the caller can copy the rest another way.
+ */
+ssize_t direct_copy(char *src_path, char *dest_path, FILE *dest, size_t size) {
+    char *in = NULL, *out = NULL;
+    struct stat dest_stat;
+    size_t copied = 0, out_len, whole;
+    off_t out_offset;
+    ssize_t read_size, appended = -1;
+    int src_fd, dest_fd = -1, failed = 0;
+
+    fflush(dest);
+    src_fd = open(src_path, O_RDONLY | O_DIRECT);
+    if (src_fd < 0 || fstat(fileno(dest), &dest_stat) != 0 ||
+        (dest_fd = open(dest_path, O_RDWR | O_DIRECT)) < 0 ||
+        (in = buffer_lease()) == NULL || (out = buffer_lease()) == NULL)
+        goto cleanup;
+
+    // Start from the partial block at the end of dest, so writes stay aligned
+    out_offset = dest_stat.st_size - dest_stat.st_size % DIRECT_ALIGN;
+    out_len = dest_stat.st_size - out_offset;
+    if (out_len > 0 && pread(dest_fd, out, DIRECT_ALIGN, out_offset) != (ssize_t)out_len)
+        goto cleanup;
+
+    // Read the source a block short of the buffer size, so that the out buffer
+    // always has room for what is left over from the previous block
+    while (copied < size) {
+        read_size = pread(src_fd, in, POOL_BUF_SIZE - DIRECT_ALIGN, copied);
+        if (read_size <= 0)
+            break;
+        if ((size_t)read_size > size - copied)
+            read_size = size - copied;
+        memcpy(out + out_len, in, read_size);
+        out_len += read_size;
+        copied += read_size;
+
+        whole = out_len - out_len % DIRECT_ALIGN;
+        if (whole > 0) {
+            if (direct_write(dest_fd, out, whole, out_offset) != 0) {
+                print_log(1, "read_file", "Cannot write to \"%s\": %s", dest_path, strerror(errno));
+                failed = 1;
+                break;
+            }
+            out_offset += whole;
+            out_len -= whole;
+            memmove(out, out + whole, out_len);
+        }
+    }
+
+    // The unaligned tail goes through the page cache, at its own offset rather
+    // than at the end of dest, which a failed write may have moved
+    if (!failed && out_len > 0) {
+        fcntl(dest_fd, F_SETFL, fcntl(dest_fd, F_GETFL) & ~O_DIRECT);
+        if (pwrite(dest_fd, out, out_len, out_offset) == (ssize_t)out_len)
+            out_offset += out_len;
+        else
+            print_log(1, "read_file", "Cannot write to \"%s\": %s", dest_path, strerror(errno));
+    }
+
+    // Cut dest back to the bytes appended in full, so the caller can go on from there
+    appended = out_offset > dest_stat.st_size ? out_offset - dest_stat.st_size : 0;
+    if ((size_t)appended < size) {
+        if (ftruncate(dest_fd, dest_stat.st_size + appended) != 0)
+            print_log(1, "read_file", "Cannot truncate \"%s\": %s", dest_path, strerror(errno));
+    } else
+        __sync_fetch_and_add(&stat_direct_reads, 1);
+    if (appended == 0)
+        appended = -1;
+
+cleanup:
+    if (src_fd >= 0)
+        close(src_fd);
+    if (dest_fd >= 0)
+        close(dest_fd);
+    if (in != NULL)
+        buffer_release(in);
+    if (out != NULL)
+        buffer_release(out);
+    return appended;
+}
+
+/**
+ * @fn ssize_t copy_chunk(copy_job *job, off_t offset, size_t length)
+ * @brief Copy a chunk of a file to the same offset in the destination region,
+ *        with copy_file_range() where the filesystems allow it, and through
+ *        a leased pool buffer otherwise.
+ * @param job copy_job of the file.
+ * @param offset Offset of the chunk in the source.
+ * @param length Length of the chunk.
+ * @return Number of bytes copied, short of length if the source ended early, or -1 on failure.
+ */
+ssize_t copy_chunk(copy_job *job, off_t offset, size_t length) {
+    loff_t in_offset = offset, out_offset = job->dest_base + offset;
+    size_t copied = 0;
+    ssize_t result;
+    char *buf;
+
+    while (copied < length) {
+        result = copy_file_range(job->src_fd, &in_offset, job->dest_fd, &out_offset, length - copied, 0);
+        if (result < 0 && copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            break;
+        if (result < 0)
+            return -1;
+        if (result == 0)
+            return copied;
+        copied += result;
+    }
+    if (copied == length)
+        return copied;
+
+    // The filesystems cannot copy in the kernel, so copy through a buffer
+    if ((buf = buffer_lease()) == NULL)
+        return -1;
+    while (copied < length) {
+        result = pread(job->src_fd, buf, length - copied < POOL_BUF_SIZE ? length - copied : POOL_BUF_SIZE, offset + copied);
+        if (result <= 0 || pwrite(job->dest_fd, buf, result, job->dest_base + offset + copied) != result)
+            break;
+        copied += result;
+    }
+    buffer_release(buf);
+    return result < 0 ? -1 : (ssize_t)copied;
+}
+
+/**
+ * @fn void *copy_chunks(void *arg)
+ * @brief Copy chunks of a file until none are left. The destination is only valid up to
+ *        copied_to, which a chunk that fails or finds the source ended lowers.
+ * @param arg copy_job of the file.
+ */
+void *copy_chunks(void *arg) {
+    copy_job *job = (copy_job *)arg;
+    size_t offset, length, end, seen;
+    ssize_t copied;
+    int chunk;
+
+    while ((chunk = __sync_fetch_and_add(&job->next, 1)) < job->chunk_count) {
+        offset = (size_t)chunk * PARALLEL_CHUNK;
+        length = job->size - offset < PARALLEL_CHUNK ? job->size - offset : PARALLEL_CHUNK;
+        copied = copy_chunk(job, offset, length);
+        if (copied == (ssize_t)length)
+            continue;
+
+        // Keep copied_to at the lowest end of the source seen, or failed chunk
+        if (copied < 0) {
+            job->failed = 1;
+            copied = 0;
+        }
+        end = offset + copied;
+        for (seen = job->copied_to; end < seen; seen = job->copied_to)
+            if (__sync_bool_compare_and_swap(&job->copied_to, seen, end))
+                break;
+    }
+    return NULL;
+}
+
+/**
+ * @fn ssize_t parallel_copy(char *src_path, char *dest_path, FILE *dest, size_t size)
+ * @brief Append the first size bytes of a large regular file to dest by copying its
+ *        chunks concurrently into a region preallocated at the end of dest, on this
+ *        thread and as many helper threads as there are idle CPUs, up to READ_FANOUT
+ *        threads in all. CPUs are idle if they are not running workers doing file I/O
+ *        (or shards) or other helpers. If the source turns out to be shorter than size,
+ *        or a chunk cannot be copied, dest is cut back to the end of the chunks before it.
+ *        The caller must hold the lock on dest.
+ * @param src_path The file path.
+ * @param dest_path Path to the destination file.
+ * @param dest The destination file, open for appending.
+ * @param size Number of bytes to copy.
+ * @return Number of bytes appended, which is less than size if the copy was cut short,
+ *         or -1 if nothing was appended, as when there are no CPUs to spare or the files
+ *         cannot be opened.
+ */
+ssize_t parallel_copy(char *src_path, char *dest_path, FILE *dest, size_t size) {
+    copy_job job = {-1, -1, 0, size, size, 0, 0, 0};
+    pthread_t helpers[READ_FANOUT];
+    struct stat dest_stat;
+    int cpus = cpu_count > 0 ? cpu_count : sysconf(_SC_NPROCESSORS_ONLN);
+    int helper_count, helper;
+    ssize_t return_value = -1;
+
+    // Only take CPUs nothing else is using
+    job.chunk_count = (size + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    helper_count = cpus - 1 - copy_helpers - shard_count -
+                   (__atomic_load_n(&pool_working, __ATOMIC_SEQ_CST) - __atomic_load_n(&pool_sleeping, __ATOMIC_SEQ_CST));
+    if (helper_count > READ_FANOUT - 1)
+        helper_count = READ_FANOUT - 1;
+    if (helper_count > job.chunk_count - 1)
+        helper_count = job.chunk_count - 1;
+    if (helper_count < 1)
+        return -1;
+
+    // Preallocate the region at the end of dest, and write into it at offsets
+    fflush(dest);
+    if (fstat(fileno(dest), &dest_stat) != 0 ||
+        (job.src_fd = open(src_path, O_RDONLY)) < 0 || (job.dest_fd = open(dest_path, O_WRONLY)) < 0)
+        goto cleanup;
+    job.dest_base = dest_stat.st_size;
+    if (fallocate(job.dest_fd, 0, job.dest_base, size) != 0 && ftruncate(job.dest_fd, job.dest_base + size) != 0)
+        goto cleanup;
+
+    __sync_fetch_and_add(&copy_helpers, helper_count);
+    for (helper = 0; helper < helper_count; helper++)
+        if (pthread_create(&helpers[helper], NULL, copy_chunks, &job) != 0)
+            break;
+    __sync_fetch_and_sub(&copy_helpers, helper_count - helper);
+    helper_count = helper;
+    copy_chunks(&job);
+    for (helper = 0; helper < helper_count; helper++)
+        pthread_join(helpers[helper], NULL);
+    __sync_fetch_and_sub(&copy_helpers, helper_count);
+
+    // Keep what was copied in full, for the caller to go on from there
+    if (job.failed)
+        print_log(1, "read_file", "Cannot copy all of \"%s\" into \"%s\": %s", src_path, dest_path, strerror(errno));
+    else if (job.copied_to < size)
+        print_log(1, "read_file", "File \"%s\" was cut short at %zu bytes while being read.", src_path, job.copied_to);
+    if (job.copied_to < size && ftruncate(job.dest_fd, job.dest_base + job.copied_to) != 0)
+        print_log(1, "read_file", "Cannot cut \"%s\" back: %s", dest_path, strerror(errno));
+    if (!job.failed) {
+        __sync_fetch_and_add(&stat_parallel_copies, 1);
+        __sync_fetch_and_add(&stat_parallel_helpers, helper_count);
+    }
+    if (job.copied_to > 0)
+        return_value = job.copied_to;
+
+cleanup:
+    if (job.src_fd >= 0)
+        close(job.src_fd);
+    if (job.dest_fd >= 0)
+        close(job.dest_fd);
+    return return_value;
+}
+
+/**
+ * @fn int read_file(char *src_path, char *dest_path, char *cmdline, int before_empty)
+ * @brief Append text from a file located at *file_path to <READ_FILE>.
+ *        If the file exists, append the following to <READ_FILE>:
+ *            <cmdline>: <contents>\n
+ *        If the file does not exist, append the following to <READ_FILE>:
+ *            <cmdline>: FILE DNE\n
+ *        Or, if before_empty is non-zero, append the following to <READ_FILE>:
+ *            <cmdline>: FILE ALREADY EMPTY\n
+ *        Regular files of DIRECT_IO_MIN bytes or more are copied with direct I/O (see direct_copy()).
+ *        Otherwise, from PARALLEL_COPY_MIN bytes, idle CPUs copy chunks in parallel
+ *        (see parallel_copy()), and from MMAP_READ_MIN bytes, they are copied from
+ *        a mapping (see mmap_copy()). Each falls back to the next if it fails.
+ * 
+ * @param src_path Path to the source file, consisting of at most 50 characters.
+ * @param dest_path Path to the destination file, consisting of at most 50 characters.
+ * @param cmdline Command line used to call the function.
+ * @param before_empty Set to a non-zero value if being called right before empty_file().
+ *        Contents of DROP_BEHIND_MIN bytes or more are then dropped from the page cache.
+ * @return 0 on success, -1 on failure.
+ */
+int read_file(char *src_path, char *dest_path, char *cmdline, int before_empty) {
+    storage_engine *engine = engine_for(src_path);
+    FILE *dest;
+    char *buf, *dest_buf = NULL;
+    size_t size, offset;
+    off_t record_offset;
+    ssize_t read_size;
+    int return_value = 0;
+
+    // Check that we are not reading content into the same file
+    if (strcmp(src_path, dest_path) == 0) {
+        print_log(1, "read_file", "Cannot read file \"%s\" into itself.", src_path);
+        return -1;
+    }
+    writeback_flush(src_path);
+
+    // We already hold a lock on the source file, so we need to acquire
+    // a lock on the destination file.
+    // To do this, we enqueue a dummy parcel for the destination file
+    // and wait for its corresponding lock.
+    print_log(0, "read_file", "Attempting to acquire lock on destination file \"%s\".", dest_path);
+    enqueue(dest_path);
+    print_log(0, "read_file", "Acquired lock on destination file \"%s\".", dest_path);
+    record_offset = output_offset(dest_path);
+
+    // Open destination now that we hold a lock on it.
+    dest = fopen(dest_path, "a");
+    if (dest == NULL) {
+        // Could not open file. Print error.
+        print_log(1, "read_file", "Cannot open file \"%s\" for appending.", dest_path);
+        return_value = -1;
+        goto cleanup;
+    }
+    dest_buf = buffer_lease();
+    if (dest_buf != NULL)
+        setvbuf(dest, dest_buf, _IOFBF, POOL_BUF_SIZE);
+
+    // Check if file exists
+    if (!engine->exists(src_path)) {
+        // File does not exist. Print FILE DNE to READ_FILE.
+        if (before_empty == 0)
+            fprintf(dest, "%s: FILE DNE\n", cmdline);
+        else
+            fprintf(dest, "%s: FILE ALREADY EMPTY\n", cmdline);
+        print_log(1, "read_file", "File \"%s\" does not exist.", src_path);
+        return_value = -1;
+        fclose(dest);
+        mark_dirty(dest_path);
+        output_appended(dest_path, output_seq, record_offset);
+        goto cleanup;
+    }
+
+    // Determine the size of the source.
+    if (engine->stat(src_path, &size) != 0) {
+        // Could not open file. Print error.
+        print_log(1, "read_file", "Cannot open file \"%s\" for reading.", src_path);
+        return_value = -1;
+        fclose(dest);
+        goto cleanup;
+    }
+
+    // Append the command line to dest
+    if (cmdline != NULL)
+        fprintf(dest, "%s: ", cmdline);
+
+    // Append source content to dest: very large regular files with direct I/O, so they
+    // stay out of the page cache, large ones in parallel chunks if CPUs are to spare,
+    // or else straight from a mapping. Other files, and the rest of a direct or parallel
+    // copy that was cut short, are copied in chunks of POOL_BUF_SIZE.
+    offset = 0;
+    if (engine == &posix_engine && size >= DIRECT_IO_MIN && (read_size = direct_copy(src_path, dest_path, dest, size)) >= 0)
+        offset = read_size;
+    else if (engine == &posix_engine && size >= PARALLEL_COPY_MIN && (read_size = parallel_copy(src_path, dest_path, dest, size)) >= 0)
+        offset = read_size;
+    else if (engine == &posix_engine && size >= MMAP_READ_MIN && (read_size = mmap_copy(src_path, dest)) >= 0)
+        offset = size;
+    if (offset < size && (buf = buffer_lease()) != NULL) {
+        for (; offset < size; offset += read_size) {
+            read_size = engine->read_range(src_path, buf, size - offset < POOL_BUF_SIZE ? size - offset : POOL_BUF_SIZE, offset);
+            if (read_size <= 0)
+                break;
+            fwrite(buf, 1, read_size, dest);
+        }
+        buffer_release(buf);
+    }
+    fprintf(dest, "\n");
+
+    // A large empty's contents are not read again, so keep them out of the page cache.
+    // Pages of <EMPTY_FILE> still being written back are dropped by a later empty.
+    if (before_empty && size >= DROP_BEHIND_MIN) {
+        if (engine->advise != NULL)
+            engine->advise(src_path, POSIX_FADV_DONTNEED);
+        if (fflush(dest) == 0)
+            posix_fadvise(fileno(dest), 0, 0, POSIX_FADV_DONTNEED);
+        __sync_fetch_and_add(&stat_dropped, size);
+    }
+
+    // Close dest
+    if (fflush(dest) == 0)
+        preallocate(dest_path, fileno(dest));
+    fclose(dest);
+    mark_dirty(dest_path);
+    output_appended(dest_path, output_seq, record_offset);
+    print_log(0, "read_file", "Successfully read file \"%s\" into \"%s\".", src_path, dest_path);
+
+cleanup:
+    // Dequeue this thread from the destination file's queue.
+    dequeue(dest_path);
+    if (dest_buf != NULL)
+        buffer_release(dest_buf);
+
+    return return_value;
+}
+
+/**
+ * @fn void *read_record(void *arg)
+ * @brief Read files of a multi-file read into their records until none are left.
+ *        Each record reads the same as the output of a single read:
+ *            read <path>: <contents>\n
+ *        or, if the file does not exist:
+ *            read <path>: FILE DNE\n
+ * @param arg read_batch of the multi-file read.
+ */
+void *read_record(void *arg) {
+    read_batch *batch = (read_batch *)arg;
+    char *src_path, *record, *contents;
+    size_t header_len, content_len;
+    int index;
+
+    while ((index = __sync_fetch_and_add(&batch->next, 1)) < batch->parcel->source_count) {
+        src_path = batch->parcel->sources[index];
+        writeback_flush(src_path);
+        contents = engine_for(src_path)->read_all(src_path, &content_len);
+        if (contents == NULL) {
+            print_log(1, "read_files", "File \"%s\" does not exist.", src_path);
+            record = malloc(strlen(src_path) + 17);
+            batch->lengths[index] = sprintf(record, "read %s: FILE DNE\n", src_path);
+        } else {
+            header_len = strlen(src_path) + 7;
+            record = malloc(header_len + content_len + 1);
+            sprintf(record, "read %s: ", src_path);
+            memcpy(record + header_len, contents, content_len);
+            batch->lengths[index] = header_len + content_len;
+            record[batch->lengths[index]++] = '\n';
+            free(contents);
+        }
+        batch->records[index] = record;
+    }
+    return NULL;
+}
+
+/**
+ * @fn int read_files(thread_parcel *parcel)
+ * @brief Append the contents of every file of a multi-file read to <READ_FILE>,
+ *        as one contiguous batch of records in path order (see read_record()).
+ *        The caller must hold the locks of all the files, or in shard mode, run while
+ *        the shards that own them wait (see shard_gather()). The files are read in
+ *        parallel, and <READ_FILE> is only locked to append the finished batch.
+ * @param parcel thread_parcel of the request.
+ * @return 0 on success, -1 on failure.
+ */
+int read_files(thread_parcel *parcel) {
+    read_batch batch = {parcel, NULL, NULL, 0};
+    pthread_t readers[READ_FANOUT];
+    int reader_count, reader, index, return_value = 0;
+    char *dest_buf;
+    off_t record_offset;
+    FILE *dest;
+
+    batch.records = calloc(parcel->source_count, sizeof(char *));
+    batch.lengths = calloc(parcel->source_count, sizeof(size_t));
+
+    // Fan the files out over up to READ_FANOUT threads, this one included
+    reader_count = parcel->source_count < READ_FANOUT ? parcel->source_count : READ_FANOUT;
+    if (cpu_count > 0 && reader_count > cpu_count)
+        reader_count = cpu_count;
+    for (reader = 1; reader < reader_count; reader++)
+        if (pthread_create(&readers[reader], NULL, read_record, &batch) != 0)
+            break;
+    reader_count = reader;
+    read_record(&batch);
+    for (reader = 1; reader < reader_count; reader++)
+        pthread_join(readers[reader], NULL);
+
+    // Append the whole batch at once, so no other output lands in between
+    enqueue(READ_FILE);
+    record_offset = output_offset(READ_FILE);
+    dest = fopen(READ_FILE, "a");
+    if (dest == NULL) {
+        print_log(1, "read_files", "Cannot open file \"%s\" for appending.", READ_FILE);
+        return_value = -1;
+    } else {
+        if ((dest_buf = buffer_lease()) != NULL)
+            setvbuf(dest, dest_buf, _IOFBF, POOL_BUF_SIZE);
+        for (index = 0; index < parcel->source_count; index++)
+            fwrite(batch.records[index], 1, batch.lengths[index], dest);
+        if (fflush(dest) == 0)
+            preallocate(READ_FILE, fileno(dest));
+        fclose(dest);
+        mark_dirty(READ_FILE);
+        output_appended(READ_FILE, parcel->seq, record_offset);
+        if (dest_buf != NULL)
+            buffer_release(dest_buf);
+        print_log(0, "read_files", "Successfully read %d files into \"%s\".", parcel->source_count, READ_FILE);
+    }
+    dequeue(READ_FILE);
+
+    for (index = 0; index < parcel->source_count; index++)
+        free(batch.records[index]);
+    free(batch.records);
+    free(batch.lengths);
+    return return_value;
+}
+
+/**
+ * @fn int empty_file(char *file_path, char *cmdline)
+ * @brief Empty the contents of a file located at *file_path into <EMPTY_FILE>.
+ * @param file_path Path to the file, consisting of at most 50 characters.
+ * @param cmdline Command line used to call the function.
+ * @return 0 on success, -1 on failure.
+ */
+int empty_file(char *file_path, char *cmdline) {
+    storage_engine *engine = engine_for(file_path);
+	int wait_s = 7 + (rand() % 4);      // Returns a pseudo-random integer between 7 and 10, inclusive
+
+    writeback_flush(file_path);
+    // Check if file exists
+    if (engine->exists(file_path)) {
+        // File exists. Empty it.
+        if (engine->truncate(file_path) != 0)
+            return -1;
+        mark_dirty(file_path);
+
+        // Project requirement: wait for a random amount of time
+        // between 7 to 10 sec, inclusive
+        if (skip_sleep == 0) {
+            print_log(0, "empty_file", "%s emptied. Sleeping for %d seconds...", file_path, wait_s);
+            spec_sleep(wait_s * 1000000);
+        } else {
+            print_log(0, "empty_file", "%s emptied.", file_path);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @fn int report_status(thread_parcel *parcel, char *status)
+ * @brief Complete a request that was not carried out, with an explicit status.
+ *        For reads and empties, append the following to <READ_FILE> or <EMPTY_FILE>:
+ *            <cmdline>: <status>\n
+ *        Writes have no output file, so their status is only logged.
+ *        With crash recovery (-k), the status is recorded first (see save_outcome()).
+ * @param parcel thread_parcel of the request.
+ * @param status The status, e.g. "TIMED OUT".
+ * @return -1, since the request was not carried out.
+ */
+int report_status(thread_parcel *parcel, char *status) {
+    char *dest_path, *line;
+    off_t record_offset;
+
+    apply_begin();
+    save_outcome(parcel, status);
+    if (parcel->request_type == REQUEST_READ)
+        dest_path = READ_FILE;
+    else if (parcel->request_type == REQUEST_EMPTY)
+        dest_path = EMPTY_FILE;
+    else {
+        print_log(1, "report_status", "%s: %s", parcel->cmdline, status);
+        apply_end(parcel);
+        return -1;
+    }
+
+    line = malloc(strlen(parcel->cmdline) + strlen(status) + 4);
+    sprintf(line, "%s: %s\n", parcel->cmdline, status);
+    enqueue(dest_path);
+    record_offset = output_offset(dest_path);
+    write_file(dest_path, line, 0);
+    output_appended(dest_path, parcel->seq, record_offset);
+    dequeue(dest_path);
+    commit_request();
+    apply_end(parcel);
+    free(line);
+    return -1;
+}
+
+/**
+ * @fn int archive_file(thread_parcel *parcel)
+ * @brief Empty a file by renaming it into the empty archive (-e), instead of
+ *        copying its contents into <EMPTY_FILE>. An empty file is left in its place,
+ *        and the following index entry is appended to <EMPTY_FILE>:
+ *            <cmdline>: ARCHIVED <segment path> <size in bytes>\n
+ *        If the file does not exist, append the following to <EMPTY_FILE>:
+ *            <cmdline>: FILE ALREADY EMPTY\n
+ *        The caller must hold the file's lock. The file's contents are never copied.
+ * @param parcel thread_parcel of the request.
+ * @return 0 on success, -1 if the file does not exist, or 1 if the file cannot be
+ *         renamed into the archive (e.g. across filesystems) and must be copied instead.
+ */
+int archive_file(thread_parcel *parcel) {
+    struct stat file_stat;
+    char *segment, *line;
+    off_t record_offset;
+    FILE *file;
+    int attempt = 0;
+
+    // Only regular files can be moved into the archive
+    if (storage != &posix_engine)
+        return 1;
+    writeback_flush(parcel->path);
+
+    if (stat(parcel->path, &file_stat) != 0) {
+        print_log(1, "archive_file", "File \"%s\" does not exist.", parcel->path);
+        return report_status(parcel, "FILE ALREADY EMPTY");
+    }
+
+    // Move the file into the archive, and leave an empty file in its place.
+    // Unlike rename(), link() fails instead of replacing a segment of the same name.
+    segment = malloc(strlen(archive_dir) + 64);
+    sprintf(segment, "%s/%ld-%lu.seg", archive_dir, archive_run, parcel->seq);
+    while (link(parcel->path, segment) != 0) {
+        if (errno != EEXIST || ++attempt > ARCHIVE_ATTEMPTS) {
+            print_log(1, "archive_file", "Cannot move \"%s\" into the archive (%s), copying it instead.",
+                      parcel->path, strerror(errno));
+            free(segment);
+            return 1;
+        }
+        sprintf(segment, "%s/%ld-%lu.%d.seg", archive_dir, archive_run, parcel->seq, attempt);
+    }
+    unlink(parcel->path);
+    file = fopen(parcel->path, "w");
+    if (file != NULL)
+        fclose(file);
+    mark_dirty(parcel->path);
+    if (file_stat.st_size >= DROP_BEHIND_MIN) {
+        posix_advise(segment, POSIX_FADV_DONTNEED);
+        __sync_fetch_and_add(&stat_dropped, file_stat.st_size);
+    }
+    __sync_fetch_and_add(&stat_archived, 1);
+
+    // Point the index entry at the segment
+    line = malloc(strlen(parcel->cmdline) + strlen(segment) + 48);
+    sprintf(line, "%s: ARCHIVED %s %lld\n", parcel->cmdline, segment, (long long)file_stat.st_size);
+    enqueue(EMPTY_FILE);
+    record_offset = output_offset(EMPTY_FILE);
+    write_file(EMPTY_FILE, line, 0);
+    output_appended(EMPTY_FILE, parcel->seq, record_offset);
+    dequeue(EMPTY_FILE);
+    print_log(0, "archive_file", "Archived \"%s\" as \"%s\".", parcel->path, segment);
+    free(line);
+    free(segment);
+
+    // Sleep as if the file had been emptied in place
+    return empty_file(parcel->path, parcel->cmdline);
+}
+
+/**
+ * @fn void thread_cleanup(thread_parcel *parcel)
+ * @brief Clean up the thread, printing errors if any.
+ * @param parcel thread_parcel of the thread to clean up.
+ */
+void thread_cleanup(thread_parcel *parcel) {
+    if (parcel->return_value != 0)
+        print_log(1, "cleanup", "Worker thread returned an error.");
+
+    // Remove the request from the in-flight list, so it can no longer be cancelled
+    if (parcel->tracked) {
+        pthread_mutex_lock(&inflight_lock);
+        if (parcel->inflight_prev != NULL)
+            parcel->inflight_prev->inflight_next = parcel->inflight_next;
+        else
+            inflight = parcel->inflight_next;
+        if (parcel->inflight_next != NULL)
+            parcel->inflight_next->inflight_prev = parcel->inflight_prev;
+        pthread_mutex_unlock(&inflight_lock);
+    }
+    journal_unlink(parcel);
+    while (parcel->source_count > 0)
+        free(parcel->sources[--parcel->source_count]);
+    free(parcel->sources);
+    free(parcel);
+    print_log(0, "cleanup", "Worker thread cleaned up.");
+}
+
+/*****************************
+ *       Thread def'ns       *
+ *****************************/
+
+/**
+ * @fn int compare_paths(const void *a, const void *b)
+ * @brief Order file paths for qsort(), in the order multi-file reads lock them.
+ * @param a Pointer to the first path.
+ * @param b Pointer to the second path.
+ * @return Negative, zero or positive as with strcmp().
+ */
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * @fn int parse_sources(thread_parcel *parcel, char *saveptr)
+ * @brief Expand the paths of a multi-file read into parcel->sources.
+ *        Each path may be a glob pattern; patterns without matches are kept as-is,
+ *        and are read as missing files. The sources are sorted and deduplicated,
+ *        so that every request locks files in the same order and cannot deadlock.
+ *        The server's own files are left out, since they are locked separately.
+ * @param parcel thread_parcel of the request, with its first path parsed.
+ * @param saveptr strtok_r() state pointing past the first path.
+ * @return 0 on success, -1 if no files are left to read.
+ */
+int parse_sources(thread_parcel *parcel, char *saveptr) {
+    glob_t matches;
+    char *pattern = parcel->path;
+    size_t match;
+
+    // Patterns are matched against the files in the storage engine
+    memset(&matches, 0, sizeof(glob_t));
+    do {
+        storage->glob(pattern, &matches);
+    } while ((pattern = strtok_r(NULL, " ", &saveptr)) != NULL);
+    qsort(matches.gl_pathv, matches.gl_pathc, sizeof(char *), compare_paths);
+
+    parcel->sources = malloc(matches.gl_pathc * sizeof(char *));
+    for (match = 0; match < matches.gl_pathc; match++) {
+        if (is_server_file(matches.gl_pathv[match]))
+            continue;
+        if (parcel->source_count > 0 && strcmp(parcel->sources[parcel->source_count - 1], matches.gl_pathv[match]) == 0)
+            continue;
+        parcel->sources[parcel->source_count++] = strdup(matches.gl_pathv[match]);
+    }
+    while (matches.gl_pathc > 0)
+        free(matches.gl_pathv[--matches.gl_pathc]);
+    free(matches.gl_pathv);
+
+    if (parcel->source_count == 0) {
+        print_log(1, "worker", "No files to read.");
+        parcel->request_type = REQUEST_INVALID;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @fn int lock_sources(thread_parcel *parcel)
+ * @brief Wait for the locks of all the files of a multi-file read, in path order.
+ *        As with a single file, the wait ends early if the deadline passes or the
+ *        request is cancelled; the locks taken so far are then released.
+ * @param parcel thread_parcel of the request.
+ * @return 0 once all locks are held, ETIMEDOUT or ECANCELED otherwise.
+ */
+int lock_sources(thread_parcel *parcel) {
+    unsigned int ticket;
+    int status = 0, source;
+
+    for (source = 0; source < parcel->source_count && status == 0; source++) {
+        if (lock_elided(parcel->sources[source]))
+            continue;
+        __atomic_store_n(&parcel->lock, reserve(parcel->sources[source], &ticket), __ATOMIC_SEQ_CST);
+        status = ticket_timedwait(parcel->sources[source], parcel->lock, ticket,
+                                  parcel->deadline.tv_sec != 0 ? &parcel->deadline : NULL, &parcel->cancelled);
+    }
+
+    // Release what we hold if we gave up on a lock
+    if (status != 0)
+        for (source -= 2; source >= 0; source--)
+            dequeue(parcel->sources[source]);
+    return status;
+}
+
+/**
+ * @fn void unlock_sources(thread_parcel *parcel)
+ * @brief Release the locks of all the files of a multi-file read.
+ * @param parcel thread_parcel of the request.
+ */
+void unlock_sources(thread_parcel *parcel) {
+    int source;
+
+    for (source = parcel->source_count - 1; source >= 0; source--)
+        dequeue(parcel->sources[source]);
+}
+
+/**
+ * @fn void prefetch_request(thread_parcel *parcel)
+ * @brief Ask the kernel to read the files of a read or empty into the page cache
+ *        in the background, while the request waits for its lock and sleeps.
+ *        In reactor mode, requests run as soon as they are parsed, so this is skipped.
+ * @param parcel thread_parcel of the parsed request.
+ */
+void prefetch_request(thread_parcel *parcel) {
+    storage_engine *engine;
+    int index;
+
+    if (run_inline || parcel->request_type == REQUEST_WRITE)
+        return;
+    if (parcel->sources == NULL) {
+        engine = engine_for(parcel->path);
+        if (engine->advise != NULL) {
+            engine->advise(parcel->path, POSIX_FADV_WILLNEED);
+            __sync_fetch_and_add(&stat_prefetched, 1);
+        }
+        return;
+    }
+    for (index = 0; index < parcel->source_count; index++) {
+        engine = engine_for(parcel->sources[index]);
+        if (engine->advise != NULL) {
+            engine->advise(parcel->sources[index], POSIX_FADV_WILLNEED);
+            __sync_fetch_and_add(&stat_prefetched, 1);
+        }
+    }
+}
+
+/**
+ * @fn int parse_request(thread_parcel *parcel)
+ * @brief Parse and validate the command line in a thread_parcel,
+ *        filling in its request type, file path, and free text.
+ *        The files of reads and empties are prefetched (see prefetch_request()).
+ * @param parcel thread_parcel of the request.
+ * @return 0 on success, -1 if the command line is invalid.
+ */
+int parse_request(thread_parcel *parcel) {
+    char *saveptr, *rest;
+    int text_len;
+
+    // Get a copy of cmdline to tokenize
+    strcpy(parcel->args, parcel->cmdline);
+    parcel->text = "";
+
+    // All valid command lines contain the command name as the first arg
+    // and a file path as the second argument.
+    // Extract them from the command line.
+    parcel->cmd = strtok_r(parcel->args, " ", &saveptr);
+    parcel->path = strtok_r(NULL, " ", &saveptr);
+    if (parcel->path == NULL) {
+        print_log(1, "worker", "Missing argument.");
+        return -1;
+    }
+
+    // Check what type of request the client sent.
+    parcel->request_type = determine_request(parcel->cmd);
+    if (parcel->request_type == REQUEST_INVALID) {
+        print_log(1, "worker", "Invalid command.");
+        return -1;
+    }
+
+    // Whatever follows the path starts one past the end of its token,
+    // however many spaces separated the command and the path.
+    rest = parcel->path + strlen(parcel->path);
+    if (parcel->cmdline[rest - parcel->args] != '\0')
+        rest++;
+
+    // A read of several files, or of a glob pattern, becomes a multi-file read.
+    if (parcel->request_type == REQUEST_READ &&
+        (*rest != '\0' || strpbrk(parcel->path, "*?[") != NULL)) {
+        if (parse_sources(parcel, saveptr) != 0)
+            return -1;
+        prefetch_request(parcel);
+        return 0;
+    }
+
+    // Optionally, the command line may contain free text as the third argument.
+    // Check if this argument is present and extract it.
+    if (*rest != '\0') {
+        // Make sure we're writing to a file.
+        if (parcel->request_type != REQUEST_WRITE) {
+            print_log(1, "worker", "Free text argument only valid for write requests.");
+            parcel->request_type = REQUEST_INVALID;
+            return -1;
+        }
+
+        // How long is the free text?
+        text_len = strlen(rest);
+        if (text_len > 50) {
+            print_log(1, "worker", "Free text argument is longer than 50 characters.");
+            parcel->request_type = REQUEST_INVALID;
+            return -1;
+        }
+
+        // The free text is the rest of the command line, spaces included.
+        // strtok_r has already cleared the separator before it.
+        parcel->text = rest;
+    }
+
+    prefetch_request(parcel);
+    return 0;
+}
+
+/**
+ * @fn void handle_request(thread_parcel *parcel)
+ * @brief Carry out a parsed request, once its file's lock is held.
+ *        The result is stored in parcel->return_value.
+ *        With crash recovery (-k), the spec-mandated sleeps are deferred until the
+ *        request is applied, so that checkpoints never wait for a sleeping request.
+ *        With a durability level (-d), the files it changed are synced before that.
+ * @param parcel thread_parcel of the request.
+ */
+void handle_request(thread_parcel *parcel) {
+    int defer_here = !defer_sleeps && checkpoint_every > 0;
+    file_t *outer_file = request_file;
+
+    // Look up the request's file once. User files in shard mode stay in their shard's
+    // table, unless write-back or crash recovery need them in the registry.
+    if (parcel->sources == NULL && parcel->path != NULL && parcel->file == NULL) {
+        if (shards != NULL && !is_server_file(parcel->path) && writeback_limit == 0 && checkpoint_every == 0) {
+            parcel->file = shard_file(parcel->path);
+        } else {
+            ticket_lock("open_files", open_files_lock);
+            parcel->file = find_file(parcel->path);
+            ticket_unlock(open_files_lock);
+        }
+    }
+    request_file = parcel->sources == NULL ? parcel->file : NULL;
+
+    output_seq = parcel->seq;
+    if (defer_here) {
+        defer_sleeps = 1;
+        deferred_us = 0;
+    }
+    apply_begin();
+    if (parcel->request_type == REQUEST_WRITE || parcel->request_type == REQUEST_EMPTY)
+        save_undo(parcel->path);
+
+    switch (parcel->request_type) {
+        case REQUEST_READ:
+            if (parcel->sources != NULL)
+                parcel->return_value = read_files(parcel);
+            else
+                parcel->return_value = read_file(parcel->path, READ_FILE, parcel->cmdline, 0);
+            break;
+        case REQUEST_WRITE:
+            parcel->return_value = write_file(parcel->path, parcel->text, 1);
+            break;
+        case REQUEST_EMPTY:
+            // With an empty archive, move the file away instead of copying it.
+            if (archive_dir != NULL && (parcel->return_value = archive_file(parcel)) <= 0)
+                break;
+            if (archive_dir != NULL)
+                __sync_fetch_and_add(&stat_archive_copied, 1);
+
+            // To avoid deadlocks, we can first read the file contents
+            // before emptying it, instead of having empty_file call
+            // read_file from within the same thread.
+            parcel->return_value = read_file(parcel->path, EMPTY_FILE, parcel->cmdline, 1);
+            if (parcel->return_value == 0)
+                parcel->return_value = empty_file(parcel->path, parcel->cmdline);
+            break;
+        default:
+            print_log(1, "worker", "Invalid request type.");
+            parcel->return_value = -1;
+    }
+
+    commit_request();
+    apply_end(parcel);
+    request_file = outer_file;
+    if (defer_here) {
+        defer_sleeps = 0;
+        if (deferred_us > 0)
+            spec_sleep(deferred_us);
+    }
+}
+
+/**
+ * @fn void *worker_thread(void *arg)
+ * @brief Worker thread that handles a single user request.
+ *        This thread will receive a request from the master thread,
+ *        parse the request, and handle the request accordingly.
+ *        Requests from the dispatch queue arrive already parsed and
+ *        with a ticket reserved for their file.
+ * @param arg thread_parcel of the thread
+ * @return 0 on success, -1 on failure (check (thread_parcel *)arg->return_value).
+ */
+void *worker_thread(void *arg) {
+    thread_parcel *parcel = (thread_parcel *)arg;
+    char *file_path;
+    int status = 0, wait_s, wait_prob = rand() % 100;
+
+    // Parse the command line, unless the dispatcher has done so already.
+    if (parcel->request_type == REQUEST_INVALID && parse_request(parcel) != 0) {
+        parcel->return_value = -1;
+        thread_cleanup(parcel);
+        return NULL;
+    }
+    file_path = parcel->path;
+
+    // Move next to the file's data before touching its registry node.
+    // Shards are already pinned, and reactor mode has no workers to move.
+    if (placement != PLACEMENT_NONE && !run_inline && shards == NULL)
+        place_thread(file_path);
+
+    // Initialize mutex and add this thread to the file queue.
+    print_log(0, "worker", "Attempting to acquire lock for file \"%s\".", file_path);
+    if (parcel->lock == NULL && parcel->sources == NULL && !lock_elided(file_path))
+        __atomic_store_n(&parcel->lock, reserve(file_path, &parcel->ticket), __ATOMIC_SEQ_CST);
+
+    // A request gives up its place in the queue once it is cancelled or its deadline
+    // passes, including if that happened while the request was being dispatched.
+    if (__atomic_load_n(&parcel->cancelled, __ATOMIC_SEQ_CST))
+        status = ECANCELED;
+    else if (parcel->deadline.tv_sec != 0 && deadline_passed(&parcel->deadline))
+        status = ETIMEDOUT;
+    if (status != 0 && parcel->lock != NULL)
+        ticket_abandon(parcel->lock, parcel->ticket);
+    else if (parcel->sources != NULL)
+        status = lock_sources(parcel);
+    else if (parcel->lock != NULL)
+        status = ticket_timedwait(file_path, parcel->lock, parcel->ticket,
+                                  parcel->deadline.tv_sec != 0 ? &parcel->deadline : NULL, &parcel->cancelled);
+    if (status == ETIMEDOUT)
+        goto timeout;
+    if (status == ECANCELED)
+        goto cancel;
+    __atomic_store_n(&parcel->running, 1, __ATOMIC_SEQ_CST);
+    print_log(0, "worker", "Acquired lock for file \"%s\", now performing operation \"%s\".", file_path, parcel->cmd);
+
+    // Project requirement: sleep for 1 second 80% of the time, and 6 seconds 20% of the time
+    __sync_fetch_and_add(&pool_working, 1);
+    if (skip_sleep == 0) {
+        if (wait_prob < 80)
+            wait_s = 1;
+        else
+            wait_s = 6;
+        print_log(0, "worker", "Sleeping for %d sec...", wait_s);
+        spec_sleep(wait_s * 1000000);
+    }
+
+    // Handle the request once the lock is free.
+    handle_request(parcel);
+    __sync_fetch_and_sub(&pool_working, 1);
+
+    // Dequeue the file and destroy the lock.
+    print_log(0, "worker", "Releasing lock for file \"%s\"", file_path);
+    if (parcel->sources != NULL)
+        unlock_sources(parcel);
+    else
+        dequeue(file_path);
+    count_placement(file_path);
+
+    // Deallocate the thread parcel.
+    thread_cleanup(parcel);
+    return NULL;
+
+timeout:
+    print_log(1, "worker", "Deadline passed while waiting for file \"%s\".", file_path);
+    __sync_fetch_and_add(&stat_timeouts, 1);
+    parcel->return_value = report_status(parcel, "TIMED OUT");
+    thread_cleanup(parcel);
+    return NULL;
+
+cancel:
+    print_log(1, "worker", "Request #%lu cancelled while waiting for file \"%s\".", parcel->seq, file_path);
+    __sync_fetch_and_add(&stat_cancelled, 1);
+    parcel->return_value = report_status(parcel, "CANCELLED");
+    thread_cleanup(parcel);
+    return NULL;
+}
+
+/**
+ * @fn void shard_push(shard_t *shard, thread_parcel *parcel)
+ * @brief Hand a request over to a shard, blocking while its ring is full.
+ *        Only the master thread may call this.
+ * @param shard The shard to hand the request to.
+ * @param parcel thread_parcel of the request, or NULL to stop the shard.
+ */
+void shard_push(shard_t *shard, thread_parcel *parcel) {
+    sem_wait(&shard->slots);
+    shard->ring[shard->tail % SHARD_RING_SIZE] = parcel;
+    shard->tail++;
+    sem_post(&shard->items);
+}
+
+/**
+ * @fn thread_parcel *shard_pop(shard_t *shard)
+ * @brief Take the next request off a shard's ring, blocking while it is empty.
+ *        Only the shard's own thread may call this.
+ * @param shard The shard to take a request from.
+ * @return thread_parcel of the request, or NULL if the shard should stop.
+ */
+thread_parcel *shard_pop(shard_t *shard) {
+    thread_parcel *parcel;
+
+    sem_wait(&shard->items);
+    parcel = shard->ring[shard->head % SHARD_RING_SIZE];
+    shard->head++;
+    sem_post(&shard->slots);
+    return parcel;
+}
+
+/**
+ * @fn void shard_fanout(thread_parcel *parcel)
+ * @brief Hand a parsed request over to the shard that owns its file. A multi-file read
+ *        of files owned by several shards is handed to all of them, so that it runs
+ *        while none of them touches its files (see shard_gather()).
+ *        Only the master thread may call this.
+ * @param parcel thread_parcel of the request.
+ */
+void shard_fanout(thread_parcel *parcel) {
+    shard_barrier *barrier;
+    char *owners;
+    int source, shard, needed = 0;
+
+    if (parcel->sources == NULL) {
+        shard_push(shard_for(parcel->path), parcel);
+        return;
+    }
+
+    owners = calloc(shard_count, 1);
+    for (source = 0; source < parcel->source_count; source++) {
+        shard = shard_for(parcel->sources[source]) - shards;
+        if (!owners[shard])
+            owners[shard] = 1, needed++;
+    }
+    if (needed > 1) {
+        barrier = calloc(1, sizeof(shard_barrier));
+        pthread_mutex_init(&barrier->lock, NULL);
+        pthread_cond_init(&barrier->done, NULL);
+        barrier->needed = barrier->refs = needed;
+        parcel->barrier = barrier;
+    }
+
+    // The read only runs once the last owner has it, so the parcel stays valid until then
+    for (shard = 0; shard < shard_count; shard++)
+        if (owners[shard])
+            shard_push(&shards[shard], parcel);
+    free(owners);
+}
+
+/**
+ * @fn void shard_release(shard_barrier *barrier)
+ * @brief Stop using a multi-file read's barrier, freeing it once no shard uses it.
+ * @param barrier The barrier.
+ */
+void shard_release(shard_barrier *barrier) {
+    int refs;
+
+    pthread_mutex_lock(&barrier->lock);
+    refs = --barrier->refs;
+    pthread_mutex_unlock(&barrier->lock);
+    if (refs == 0) {
+        pthread_mutex_destroy(&barrier->lock);
+        pthread_cond_destroy(&barrier->done);
+        free(barrier);
+    }
+}
+
+/**
+ * @fn int shard_gather(shard_barrier *barrier)
+ * @brief Meet the other shards a multi-file read was handed to (see shard_fanout()).
+ *        All but the last shard to arrive wait until the read is done.
+ * @param barrier The barrier of the read.
+ * @return Non-zero if the calling shard arrived last, and should run the read.
+ */
+int shard_gather(shard_barrier *barrier) {
+    int last;
+
+    pthread_mutex_lock(&barrier->lock);
+    last = ++barrier->arrived == barrier->needed;
+    while (!last && !barrier->finished)
+        pthread_cond_wait(&barrier->done, &barrier->lock);
+    pthread_mutex_unlock(&barrier->lock);
+    if (!last)
+        shard_release(barrier);
+    return last;
+}
+
+/**
+ * @fn void *shard_thread(void *arg)
+ * @brief Shard thread that handles all requests for the file paths it owns.
+ *        The thread pins itself to a core, then runs each request handed to it
+ *        by the master thread to completion, in the order they were received.
+ * @param arg shard_t of the shard.
+ */
+void *shard_thread(void *arg) {
+    shard_t *shard = (shard_t *)arg;
+    shard_barrier *barrier;
+    thread_parcel *parcel;
+
+    pin_thread(cpu_ids[shard->id % cpu_count]);
+
+    while ((parcel = shard_pop(shard)) != NULL) {
+        if ((barrier = parcel->barrier) == NULL) {
+            worker_thread(parcel);
+            continue;
+        }
+
+        // A multi-file read across shards runs on the last of them to get to it
+        if (!shard_gather(barrier))
+            continue;
+        worker_thread(parcel);
+        pthread_mutex_lock(&barrier->lock);
+        barrier->finished = 1;
+        pthread_cond_broadcast(&barrier->done);
+        pthread_mutex_unlock(&barrier->lock);
+        shard_release(barrier);
+    }
+
+    print_log(0, "shard", "Shard %d stopped.", shard->id);
+    return NULL;
+}
+
+/**
+ * @fn int request_path(char *cmdline, char *path)
+ * @brief Extract the file path from a command line, without validating the command.
+ *        The command line is tokenized the same way as in parse_request(), so that
+ *        the path a request is routed by is the path it works on.
+ * @param cmdline The command line.
+ * @param path Set to the file path, or to "" if there is none. Must hold 109 characters.
+ * @return Non-zero if the command line has a file path.
+ */
+int request_path(char *cmdline, char *path) {
+    char args[109], *saveptr, *token;
+
+    path[0] = '\0';
+    strncpy(args, cmdline, sizeof(args) - 1);
+    args[sizeof(args) - 1] = '\0';
+    if (strtok_r(args, " ", &saveptr) == NULL || (token = strtok_r(NULL, " ", &saveptr)) == NULL)
+        return 0;
+    strcpy(path, token);
+    return 1;
+}
+
+/**
+ * @fn char *parse_client(char *cmdline, char *client)
+ * @brief Strip the optional "@name" or "@name:weight" client prefix off a command line.
+ * @param cmdline The command line as received.
+ * @param client Set to the client prefix without the "@", or to "" if there is none.
+ * @return The command line without the client prefix.
+ */
+char *parse_client(char *cmdline, char *client) {
+    size_t client_len;
+
+    client[0] = '\0';
+    if (cmdline[0] != '@')
+        return cmdline;
+
+    client_len = strcspn(cmdline + 1, " ");
+    strncpy(client, cmdline + 1, client_len);
+    client[client_len] = '\0';
+    cmdline += client_len + 1;
+    return cmdline + strspn(cmdline, " ");
+}
+
+/**
+ * @fn char *parse_deadline(char *cmdline, struct timespec *deadline)
+ * @brief Strip the optional "+<ms>" deadline prefix off a command line.
+ *        The deadline is relative to the time the command was received.
+ * @param cmdline The command line, after parse_client().
+ * @param deadline Set to the absolute deadline, or to zero if there is none.
+ * @return The command line without the deadline prefix.
+ */
+char *parse_deadline(char *cmdline, struct timespec *deadline) {
+    char *end;
+    long ms;
+
+    deadline->tv_sec = 0;
+    deadline->tv_nsec = 0;
+    if (cmdline[0] != '+')
+        return cmdline;
+
+    ms = strtol(cmdline + 1, &end, 10);
+    if (end == cmdline + 1 || *end != ' ' || ms < 0)
+        return cmdline;
+
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    return end + strspn(end, " ");
+}
+
+/**
+ * @fn client_t *find_client(char *client)
+ * @brief Find or register a client by its "name" or "name:weight" prefix.
+ *        A weight given with the prefix replaces the client's current weight.
+ *        The caller must hold dispatch_lock.
+ * @param client The client prefix, as returned by parse_client().
+ * @return The client.
+ */
+client_t *find_client(char *client) {
+    client_t *curr;
+    char *weight = strchr(client, ':');
+    size_t name_len = weight != NULL ? weight - client : strlen(client);
+
+    for (curr = clients; curr != NULL; curr = curr->next)
+        if (strncmp(curr->name, client, name_len) == 0 && curr->name[name_len] == '\0')
+            break;
+
+    if (curr == NULL) {
+        curr = calloc(1, sizeof(client_t));
+        strncpy(curr->name, client, name_len);
+        curr->weight = 1;
+        curr->bucket.tokens = client_limit.burst;
+        clock_gettime(CLOCK_MONOTONIC, &curr->bucket.last);
+        curr->finish = virtual_time;
+        curr->next = clients;
+        clients = curr;
+    }
+    if (weight != NULL && atof(weight + 1) > 0)
+        curr->weight = atof(weight + 1);
+    return curr;
+}
+
+/**
+ * @fn void dispatch_push(thread_parcel *parcel, char *client)
+ * @brief Place a parsed request at the tail of the dispatch queue.
+ *        The request is tagged with a virtual finish time, which advances
+ *        each client's clock by the request's cost divided by its weight
+ *        (start-time fair queuing). See dispatch_pop().
+ * @param parcel thread_parcel of the request.
+ * @param client The client prefix of the request, as returned by parse_client(),
+ *        or NULL if parcel->client is set already (see admit_request()).
+ */
+void dispatch_push(thread_parcel *parcel, char *client) {
+    double cost;
+
+    switch (parcel->request_type) {
+        case REQUEST_READ:  cost = COST_READ;  break;
+        case REQUEST_WRITE: cost = COST_WRITE; break;
+        default:            cost = COST_EMPTY;
+    }
+
+    pthread_mutex_lock(&dispatch_lock);
+    if (client != NULL)
+        parcel->client = find_client(client);
+    if (parcel->client->finish < virtual_time)
+        parcel->client->finish = virtual_time;
+    parcel->client->finish += cost / parcel->client->weight;
+    parcel->finish = parcel->client->finish;
+
+    parcel->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &parcel->queued_at);
+    if (dispatch_tail != NULL)
+        dispatch_tail->next = parcel;
+    else
+        dispatch_head = parcel;
+    dispatch_tail = parcel;
+    dispatch_length++;
+    pthread_cond_signal(&dispatch_ready);
+    pthread_mutex_unlock(&dispatch_lock);
+}
+
+/**
+ * @fn int dispatchable(thread_parcel *parcel, struct timespec *wake)
+ * @brief Checks whether a queued request can be dispatched without its pool thread
+ *        having to wait for the file: nobody holds or waits for the file, or the request
+ *        will not take a ticket for it right away. The caller must hold dispatch_lock
+ *        and open_files_lock.
+ * @param parcel thread_parcel of the request.
+ * @param wake Moved up to the request's deadline, if it is earlier and the request
+ *        cannot be dispatched yet.
+ * @return Non-zero if the request can be dispatched.
+ */
+int dispatchable(thread_parcel *parcel, struct timespec *wake) {
+    file_t *file;
+    int idle;
+
+    // Cancelled and expired requests are turned away by the worker without a ticket,
+    // and multi-file reads take their tickets once they run
+    if (__atomic_load_n(&parcel->cancelled, __ATOMIC_SEQ_CST) || parcel->sources != NULL ||
+        (parcel->deadline.tv_sec != 0 && deadline_passed(&parcel->deadline)))
+        return 1;
+
+    if ((file = lookup_file(parcel->path)) == NULL)
+        return 1;
+    pthread_mutex_lock(&file->lock->lock);
+    idle = file->lock->curr == file->lock->waiting;
+    pthread_mutex_unlock(&file->lock->lock);
+    if (!idle && deadline_before(&parcel->deadline, wake))
+        *wake = parcel->deadline;
+    return idle;
+}
+
+/**
+ * @fn thread_parcel *dispatch_pop()
+ * @brief Take the next request off the dispatch queue, blocking while none can be
+ *        dispatched. Only requests whose file is free are taken, so that pool threads
+ *        never wait for a file while requests for other files are queued behind them.
+ *        With the FIFO policy this is the oldest such request. With the fair policy it is
+ *        the one with the earliest virtual finish time, and with the read policy
+ *        the same, except that reads go before any write or empty. With the EDF policy
+ *        it is the one with the earliest deadline that is not queued behind another
+ *        request for the same file, or the oldest one if none has a deadline.
+ *        The request's ticket is taken before the dispatch queue is released, so that
+ *        no other request can take the file in between. Requests left waiting for a
+ *        file are woken when it is released (see dispatch_wake()), or their deadline.
+ * @return thread_parcel of the request, or NULL if the queue is closed and empty,
+ *         or if the calling pool thread should retire.
+ */
+thread_parcel *dispatch_pop() {
+    thread_parcel *curr, *prev, *other, *best, *best_prev;
+    queue_lock *lock;
+    struct timespec wake;
+
+    pthread_mutex_lock(&dispatch_lock);
+    pool_idle++;
+    for (;;) {
+        // Pick a request according to the queue policy, among those that can be dispatched
+        best = best_prev = NULL;
+        wake.tv_sec = 0;
+        if (dispatch_head != NULL)
+            ticket_lock("open_files", open_files_lock);
+        for (prev = NULL, curr = dispatch_head; curr != NULL; prev = curr, curr = curr->next) {
+            if (!dispatchable(curr, &wake))
+                continue;
+            if (best != NULL && queue_policy == POLICY_FIFO)
+                break;
+            if (best != NULL && queue_policy == POLICY_EDF) {
+                if (!deadline_before(&curr->deadline, &best->deadline))
+                    continue;
+                for (other = dispatch_head; other != curr; other = other->next)
+                    if (strcmp(other->path, curr->path) == 0)
+                        break;
+                if (other != curr)
+                    continue;
+            } else if (best != NULL && queue_policy == POLICY_READ &&
+                       (curr->request_type == REQUEST_READ) != (best->request_type == REQUEST_READ)) {
+                if (curr->request_type != REQUEST_READ)
+                    continue;
+            } else if (best != NULL && curr->finish >= best->finish) {
+                continue;
+            }
+            best = curr;
+            best_prev = prev;
+        }
+        if (best != NULL)
+            break;
+        if (dispatch_head != NULL)
+            ticket_unlock(open_files_lock);
+        if ((dispatch_head == NULL && dispatch_closed) || pool_retire > 0) {
+            if (pool_retire > 0)
+                pool_retire--;
+            pool_idle--;
+            pthread_mutex_unlock(&dispatch_lock);
+            return NULL;
+        }
+        if (wake.tv_sec != 0)
+            pthread_cond_timedwait(&dispatch_ready, &dispatch_lock, &wake);
+        else
+            pthread_cond_wait(&dispatch_ready, &dispatch_lock);
+    }
+    pool_idle--;
+
+    // Take its ticket while open_files is still held, so the file stays free until then
+    if (!__atomic_load_n(&best->cancelled, __ATOMIC_SEQ_CST) && best->sources == NULL &&
+        !(best->deadline.tv_sec != 0 && deadline_passed(&best->deadline))) {
+        lock = find_file(best->path)->lock;
+        best->ticket = ticket_take(lock);
+        __atomic_store_n(&best->lock, lock, __ATOMIC_SEQ_CST);
+    }
+    ticket_unlock(open_files_lock);
+
+    // Unlink it from the queue
+    if (best_prev != NULL)
+        best_prev->next = best->next;
+    else
+        dispatch_head = best->next;
+    if (dispatch_tail == best)
+        dispatch_tail = best_prev;
+    dispatch_length--;
+    if (best->finish > virtual_time)
+        virtual_time = best->finish;
+    queue_wait_avg = 0.8 * queue_wait_avg + 0.2 * elapsed_since(&best->queued_at);
+    pthread_mutex_unlock(&dispatch_lock);
+    return best;
+}
+
+/**
+ * @fn void *pool_thread(void *arg)
+ * @brief Pool thread that handles requests from the dispatch queue until it is closed,
+ *        or until the pool shrinks.
+ * @param arg Unused.
+ */
+void *pool_thread(void *arg) {
+    thread_parcel *parcel;
+
+    while ((parcel = dispatch_pop()) != NULL)
+        worker_thread(parcel);
+
+    pthread_mutex_lock(&dispatch_lock);
+    pool_live--;
+    pthread_cond_broadcast(&pool_exited);
+    pthread_mutex_unlock(&dispatch_lock);
+    return NULL;
+}
+
+/**
+ * @fn void pool_grow(int workers)
+ * @brief Start more pool threads. The caller must hold dispatch_lock.
+ * @param workers The number of pool threads to start.
+ */
+void pool_grow(int workers) {
+    pthread_t thread;
+
+    while (workers-- > 0) {
+        if (pthread_create(&thread, NULL, pool_thread, NULL) != 0) {
+            print_log(1, "pool", "Could not create pool thread.");
+            break;
+        }
+        pthread_detach(thread);
+        pool_live++;
+    }
+    if (pool_live > stat_pool_peak)
+        stat_pool_peak = pool_live;
+}
+
+/**
+ * @fn void *scaler_thread(void *arg)
+ * @brief Scaler thread that resizes the worker pool between -w and -W threads.
+ *        The pool grows when requests wait longer than SCALE_TARGET_MS to be dispatched,
+ *        judging by a moving average of past waits and the age of the oldest queued
+ *        request. Since workers in file I/O are using a CPU, it only grows while fewer
+ *        workers are doing I/O than there are CPUs; workers sleeping cost nothing. Nor
+ *        does it grow while a worker is idle, since the queued requests then wait for
+ *        their file. The pool shrinks by one idle worker at a time once the waits stay
+ *        below a quarter of the target for SCALE_CALM_TICKS checks in a row.
+ * @param arg Unused.
+ */
+void *scaler_thread(void *arg) {
+    double wait_s, target_s = SCALE_TARGET_MS / 1000.0;
+    int calm_ticks = 0, workers;
+
+    pthread_mutex_lock(&dispatch_lock);
+    while (!dispatch_closed) {
+        pthread_mutex_unlock(&dispatch_lock);
+        usleep(SCALE_INTERVAL_MS * 1000);
+        pthread_mutex_lock(&dispatch_lock);
+
+        // With nothing queued, let the average decay towards zero
+        if (dispatch_head == NULL)
+            queue_wait_avg *= 0.8;
+        wait_s = queue_wait_avg;
+        if (dispatch_head != NULL && elapsed_since(&dispatch_head->queued_at) > wait_s)
+            wait_s = elapsed_since(&dispatch_head->queued_at);
+
+        if (wait_s > target_s && pool_live < pool_max && pool_idle == 0 &&
+                __atomic_load_n(&pool_working, __ATOMIC_SEQ_CST) - __atomic_load_n(&pool_sleeping, __ATOMIC_SEQ_CST) < cpu_count) {
+            // Start enough workers for the queued requests, within bounds
+            workers = dispatch_length;
+            if (workers < 1)
+                workers = 1;
+            if (workers > pool_max - pool_live)
+                workers = pool_max - pool_live;
+            print_log(0, "scaler", "Requests waiting %.1f ms, adding %d workers to %d.", wait_s * 1000, workers, pool_live);
+            pool_grow(workers);
+            stat_pool_grown++;
+            calm_ticks = 0;
+        } else if (wait_s < target_s / 4 && pool_idle > pool_retire && pool_live - pool_retire > pool_size) {
+            if (++calm_ticks >= SCALE_CALM_TICKS) {
+                print_log(0, "scaler", "Requests waiting %.1f ms, retiring a worker from %d.", wait_s * 1000, pool_live);
+                pool_retire++;
+                pthread_cond_broadcast(&dispatch_ready);
+                stat_pool_shrunk++;
+                calm_ticks = 0;
+            }
+        } else {
+            calm_ticks = 0;
+        }
+    }
+    pthread_mutex_unlock(&dispatch_lock);
+    return NULL;
+}
+
+/**
+ * @fn void ready_push(thread_parcel *parcel)
+ * @brief Hand a request in memory-budgeted mode over to the executor threads.
+ * @param parcel thread_parcel of the request, with its phase set.
+ */
+void ready_push(thread_parcel *parcel) {
+    pthread_mutex_lock(&evented_lock);
+    parcel->next = NULL;
+    if (ready_tail != NULL)
+        ready_tail->next = parcel;
+    else
+        ready_head = parcel;
+    ready_tail = parcel;
+    pthread_cond_signal(&evented_ready);
+    pthread_mutex_unlock(&evented_lock);
+}
+
+/**
+ * @fn void timer_push(thread_parcel *parcel, unsigned long wait_us)
+ * @brief Have the timer thread hand a request in memory-budgeted mode back to the
+ *        executor threads once a spec-mandated sleep has passed.
+ * @param parcel thread_parcel of the request, with its next phase set.
+ * @param wait_us The sleep period, in microseconds.
+ */
+void timer_push(thread_parcel *parcel, unsigned long wait_us) {
+    thread_parcel *swap;
+    int child, parent;
+
+    clock_gettime(CLOCK_MONOTONIC, &parcel->wake);
+    parcel->wake.tv_sec += wait_us / 1000000;
+    parcel->wake.tv_nsec += (wait_us % 1000000) * 1000;
+    if (parcel->wake.tv_nsec >= 1000000000) {
+        parcel->wake.tv_sec++;
+        parcel->wake.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&timer_lock);
+    if (timer_count == timer_size) {
+        timer_size = timer_size ? timer_size * 2 : 1024;
+        timer_heap = realloc(timer_heap, timer_size * sizeof(thread_parcel *));
+    }
+
+    // Sift the request up to its place in the heap
+    child = timer_count++;
+    timer_heap[child] = parcel;
+    while (child > 0 && deadline_before(&timer_heap[child]->wake, &timer_heap[parent = (child - 1) / 2]->wake)) {
+        swap = timer_heap[parent];
+        timer_heap[parent] = timer_heap[child];
+        timer_heap[child] = swap;
+        child = parent;
+    }
+
+    // Wake the timer thread if this is the new earliest wake time
+    if (child == 0)
+        pthread_cond_signal(&timer_ready);
+    pthread_mutex_unlock(&timer_lock);
+}
+
+/**
+ * @fn thread_parcel *timer_pop()
+ * @brief Remove the request with the earliest wake time from the timer heap.
+ *        The caller must hold timer_lock, and the heap must not be empty.
+ * @return thread_parcel of the request.
+ */
+thread_parcel *timer_pop() {
+    thread_parcel *top = timer_heap[0], *swap;
+    int parent = 0, child;
+
+    // Move the last request to the root and sift it down
+    timer_heap[0] = timer_heap[--timer_count];
+    while ((child = 2 * parent + 1) < timer_count) {
+        if (child + 1 < timer_count && deadline_before(&timer_heap[child + 1]->wake, &timer_heap[child]->wake))
+            child++;
+        if (!deadline_before(&timer_heap[child]->wake, &timer_heap[parent]->wake))
+            break;
+        swap = timer_heap[parent];
+        timer_heap[parent] = timer_heap[child];
+        timer_heap[child] = swap;
+        parent = child;
+    }
+    return top;
+}
+
+/**
+ * @fn void *timer_thread(void *arg)
+ * @brief Timer thread that hands sleeping requests in memory-budgeted mode back
+ *        to the executor threads once their wake time has passed.
+ * @param arg Unused.
+ */
+void *timer_thread(void *arg) {
+    struct timespec now;
+
+    pthread_mutex_lock(&timer_lock);
+    while (!evented_closed) {
+        if (timer_count == 0) {
+            pthread_cond_wait(&timer_ready, &timer_lock);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (deadline_before(&timer_heap[0]->wake, &now))
+            ready_push(timer_pop());
+        else
+            pthread_cond_timedwait(&timer_ready, &timer_lock, &timer_heap[0]->wake);
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return NULL;
+}
+
+/**
+ * @fn int park_on(thread_parcel *parcel, char *path)
+ * @brief Take a file for a request in memory-budgeted mode, or park the request
+ *        in the file's queue if another request holds it. A parked request is handed
+ *        to the executor threads once it is given the file, see release_file().
+ *        The caller must not touch a parked request again.
+ * @param parcel thread_parcel of the request.
+ * @param path The path of the file.
+ * @return Non-zero if the request holds the file, 0 if it was parked.
+ */
+int park_on(thread_parcel *parcel, char *path) {
+    file_t *file;
+    int granted = 0;
+
+    ticket_lock("open_files", open_files_lock);
+    file = find_file(path);
+    ticket_unlock(open_files_lock);
+
+    parcel->file = file;
+    parcel->next = NULL;
+    pthread_mutex_lock(&file->lock->lock);
+    if (!file->busy) {
+        file->busy = 1;
+        granted = 1;
+    } else if (file->parked_tail != NULL) {
+        file->parked_tail->next = parcel;
+        file->parked_tail = parcel;
+    } else {
+        file->parked_head = file->parked_tail = parcel;
+    }
+    pthread_mutex_unlock(&file->lock->lock);
+    return granted;
+}
+
+/**
+ * @fn void release_file(file_t *file)
+ * @brief Hand a file in memory-budgeted mode on to the next request parked on it, if any.
+ * @param file The file's registry node.
+ */
+void release_file(file_t *file) {
+    thread_parcel *next;
+
+    pthread_mutex_lock(&file->lock->lock);
+    next = file->parked_head;
+    if (next != NULL) {
+        file->parked_head = next->next;
+        if (file->parked_head == NULL)
+            file->parked_tail = NULL;
+    } else {
+        file->busy = 0;
+    }
+    pthread_mutex_unlock(&file->lock->lock);
+
+    if (next != NULL)
+        ready_push(next);
+}
+
+/**
+ * @fn int acquire_sources(thread_parcel *parcel)
+ * @brief Take the files of a multi-file read in memory-budgeted mode one by one,
+ *        in path order, starting from parcel->sources_held.
+ * @param parcel thread_parcel of the request.
+ * @return Non-zero if the request holds all its files, 0 if it was parked.
+ */
+int acquire_sources(thread_parcel *parcel) {
+    while (parcel->sources_held < parcel->source_count) {
+        parcel->phase = PHASE_ACQUIRE;
+        if (!park_on(parcel, parcel->sources[parcel->sources_held]))
+            return 0;
+        parcel->sources_held++;
+    }
+    parcel->phase = PHASE_START;
+    return 1;
+}
+
+/**
+ * @fn void park_request(thread_parcel *parcel)
+ * @brief Submit a parsed request in memory-budgeted mode. If its file is free,
+ *        the request goes straight to the executor threads; otherwise it is parked
+ *        in the file's queue without a thread until release_request() hands it on.
+ * @param parcel thread_parcel of the request.
+ */
+void park_request(thread_parcel *parcel) {
+    int granted;
+
+    pthread_mutex_lock(&evented_lock);
+    if (++evented_inflight > stat_inflight_peak)
+        stat_inflight_peak = evented_inflight;
+    pthread_mutex_unlock(&evented_lock);
+
+    if (parcel->sources != NULL) {
+        granted = acquire_sources(parcel);
+    } else {
+        parcel->phase = PHASE_START;
+        granted = park_on(parcel, parcel->path);
+    }
+    if (granted)
+        ready_push(parcel);
+}
+
+/**
+ * @fn void release_request(thread_parcel *parcel)
+ * @brief Finish a request in memory-budgeted mode, handing its files on to the
+ *        next parked requests, if any.
+ * @param parcel thread_parcel of the request.
+ */
+void release_request(thread_parcel *parcel) {
+    int source;
+
+    if (parcel->sources == NULL)
+        release_file(parcel->file);
+    for (source = 0; source < parcel->sources_held; source++) {
+        ticket_lock("open_files", open_files_lock);
+        parcel->file = find_file(parcel->sources[source]);
+        ticket_unlock(open_files_lock);
+        release_file(parcel->file);
+    }
+    count_placement(parcel->path);
+    thread_cleanup(parcel);
+
+    pthread_mutex_lock(&evented_lock);
+    if (--evented_inflight == 0)
+        pthread_cond_broadcast(&evented_done);
+    pthread_mutex_unlock(&evented_lock);
+}
 
-    // Open source.
-    src = fopen(src_path, "r");
-    if (src != NULL) {
-        // Append the command line to dest
-        if (cmdline != NULL)
-            fprintf(dest, "%s: ", cmdline);
+/**
+ * @fn void *executor_thread(void *arg)
+ * @brief Executor thread that moves requests in memory-budgeted mode through their phases:
+ *        PHASE_START once the request holds its file, where it sleeps for 1 or 6 seconds;
+ *        PHASE_RUN, where the request is carried out with its sleeps deferred; and
+ *        PHASE_RELEASE once the deferred sleeps are over. A request only holds the executor
+ *        while it has work to do, and sleeps on the timer heap otherwise. Multi-file reads
+ *        come back in PHASE_ACQUIRE each time they are handed one of their files.
+ * @param arg Unused.
+ */
+void *executor_thread(void *arg) {
+    thread_parcel *parcel;
+    int wait_s;
 
-        // Append source content to dest in chunks of READ_BUF_SIZE
-        while ((read_size = fread(buf, 1, READ_BUF_SIZE, src)) > 0)
-            fwrite(buf, 1, read_size, dest);
-        fprintf(dest, "\n");
+    while (1) {
+        pthread_mutex_lock(&evented_lock);
+        while (ready_head == NULL && !evented_closed)
+            pthread_cond_wait(&evented_ready, &evented_lock);
+        parcel = ready_head;
+        if (parcel == NULL) {
+            pthread_mutex_unlock(&evented_lock);
+            break;
+        }
+        ready_head = parcel->next;
+        if (ready_head == NULL)
+            ready_tail = NULL;
+        pthread_mutex_unlock(&evented_lock);
 
-        // Close source and dest
-        fclose(src);
-        fclose(dest);
-        print_log(0, "read_file", "Successfully read file \"%s\" into \"%s\".", src_path, dest_path);
-    } else {
-        // Could not open file. Print error.
-        print_log(1, "read_file", "Cannot open file \"%s\" for reading.", src_path);
-        return_value = -1;
-    }
+        switch (parcel->phase) {
+            case PHASE_ACQUIRE:
+                parcel->sources_held++;
+                if (!acquire_sources(parcel))
+                    break;
+                // fall through
+            case PHASE_START:
+                // Parked requests are cancelled or timed out once their turn comes
+                if (__atomic_load_n(&parcel->cancelled, __ATOMIC_SEQ_CST)) {
+                    __sync_fetch_and_add(&stat_cancelled, 1);
+                    parcel->return_value = report_status(parcel, "CANCELLED");
+                    release_request(parcel);
+                    break;
+                }
+                if (parcel->deadline.tv_sec != 0 && deadline_passed(&parcel->deadline)) {
+                    __sync_fetch_and_add(&stat_timeouts, 1);
+                    parcel->return_value = report_status(parcel, "TIMED OUT");
+                    release_request(parcel);
+                    break;
+                }
+                __atomic_store_n(&parcel->running, 1, __ATOMIC_SEQ_CST);
 
-cleanup:
-    // Dequeue this thread from the destination file's queue.
-    dequeue(dest_path);
+                // Project requirement: sleep for 1 second 80% of the time, and 6 seconds 20% of the time
+                parcel->phase = PHASE_RUN;
+                if (skip_sleep == 0) {
+                    wait_s = rand() % 100 < 80 ? 1 : 6;
+                    timer_push(parcel, wait_s * 1000000);
+                    break;
+                }
+                // fall through
+            case PHASE_RUN:
+                // The server's own files may also be locked by read_file() in other requests
+                if (is_server_file(parcel->path))
+                    enqueue(parcel->path);
+                defer_sleeps = 1;
+                deferred_us = 0;
+                handle_request(parcel);
+                defer_sleeps = 0;
+                if (is_server_file(parcel->path))
+                    dequeue(parcel->path);
 
-    return return_value;
+                parcel->phase = PHASE_RELEASE;
+                if (deferred_us > 0) {
+                    timer_push(parcel, deferred_us);
+                    break;
+                }
+                // fall through
+            default:
+                release_request(parcel);
+        }
+    }
+    return NULL;
 }
 
 /**
- * @fn int empty_file(char *file_path, char *cmdline)
- * @brief Empty the contents of a file located at *file_path into <EMPTY_FILE>.
- * @param file_path Path to the file, consisting of at most 50 characters.
- * @param cmdline Command line used to call the function.
- * @return 0 on success, -1 on failure.
+ * @fn void track_request(thread_parcel *parcel)
+ * @brief Add a request to the in-flight list, so that it can be cancelled.
+ *        thread_cleanup() removes it again.
+ * @param parcel thread_parcel of the request, with its seq set.
  */
-int empty_file(char *file_path, char *cmdline) {
-    FILE *file;
-    char *log_line;
-	int ret, wait_s = 7 + (rand() % 4);      // Returns a pseudo-random integer between 7 and 10, inclusive
+void track_request(thread_parcel *parcel) {
+    pthread_mutex_lock(&inflight_lock);
+    parcel->inflight_prev = NULL;
+    parcel->inflight_next = inflight;
+    parcel->tracked = 1;
+    if (inflight != NULL)
+        inflight->inflight_prev = parcel;
+    inflight = parcel;
+    pthread_mutex_unlock(&inflight_lock);
+}
 
-    // Check if file exists
-    if (access(file_path, F_OK) == 0) {
-        // File exists. Open it to empty.
-        file = fopen(file_path, "w");
-        if (file == NULL) {
-            // Could not open file. Print error.
-            print_log(1, "empty_file", "Cannot open file \"%s\" for emptying.", file_path);
-            return -1;
-        }
+/**
+ * @fn void cancel_request(unsigned long seq)
+ * @brief Cancel the request with the given number, if it is still waiting to be handled.
+ *        A request deferred by a rate limit, waiting in the dispatch queue, or waiting for
+ *        its file's lock gives up its place,
+ *        and completes with a CANCELLED status (see report_status()).
+ *        Requests already holding their file's lock run to completion.
+ * @param seq The number of the request to cancel.
+ */
+void cancel_request(unsigned long seq) {
+    thread_parcel *parcel;
+    queue_lock *lock;
 
-        // Since we opened the file with the "w" flag,
-        // the system empties the file for us if it already exists,
-        // and thus all that is left to do is close it.
-        fclose(file);
+    pthread_mutex_lock(&inflight_lock);
+    for (parcel = inflight; parcel != NULL; parcel = parcel->inflight_next)
+        if (parcel->seq == seq)
+            break;
 
-        // Project requirement: wait for a random amount of time
-        // between 7 to 10 sec, inclusive
-        if (skip_sleep == 0) {
-            print_log(0, "empty_file", "%s emptied. Sleeping for %d seconds...", file_path, wait_s);
-            sleep(wait_s);
-        } else {
-            print_log(0, "empty_file", "%s emptied.", file_path);
+    if (parcel == NULL) {
+        print_log(1, "cancel", "Request #%lu is not in flight.", seq);
+    } else if (__atomic_load_n(&parcel->running, __ATOMIC_SEQ_CST)) {
+        print_log(1, "cancel", "Request #%lu is already running.", seq);
+    } else {
+        // Wake the request up if it is already waiting for its file,
+        // or in the dispatch queue for a file that is not free yet.
+        // Otherwise it will see the flag before it starts waiting.
+        print_log(0, "cancel", "Cancelling request #%lu.", seq);
+        __atomic_store_n(&parcel->cancelled, 1, __ATOMIC_SEQ_CST);
+        lock = __atomic_load_n(&parcel->lock, __ATOMIC_SEQ_CST);
+        if (lock != NULL) {
+            pthread_mutex_lock(&lock->lock);
+            pthread_cond_broadcast(&lock->queue);
+            pthread_mutex_unlock(&lock->lock);
+        } else if (pool_running) {
+            pthread_mutex_lock(&dispatch_lock);
+            pthread_cond_broadcast(&dispatch_ready);
+            pthread_mutex_unlock(&dispatch_lock);
         }
+
+        // A deferred request is started right away to report its status.
+        // limit_lock is not taken here, since the limiter holds it while tracking requests.
+        if (defer_limited)
+            pthread_cond_signal(&limit_ready);
     }
+    pthread_mutex_unlock(&inflight_lock);
+}
 
-    return 0;
+/**
+ * @fn double bucket_wait(token_bucket *bucket, rate_limit *limit)
+ * @brief Refill a token bucket for the time elapsed since its last refill,
+ *        and determine how long it takes until it holds a token.
+ * @param bucket The token bucket.
+ * @param limit The rate and burst of the bucket.
+ * @return The number of seconds until a token is available, 0 if one is available now.
+ */
+double bucket_wait(token_bucket *bucket, rate_limit *limit) {
+    struct timespec now;
+
+    if (limit->rate <= 0)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bucket->tokens += ((now.tv_sec - bucket->last.tv_sec) + (now.tv_nsec - bucket->last.tv_nsec) / 1e9) * limit->rate;
+    if (bucket->tokens > limit->burst)
+        bucket->tokens = limit->burst;
+    bucket->last = now;
+    return bucket->tokens >= 1 ? 0 : (1 - bucket->tokens) / limit->rate;
 }
 
 /**
- * @fn void thread_cleanup(thread_parcel *parcel)
- * @brief Clean up the thread, printing errors if any.
- * @param parcel thread_parcel of the thread to clean up.
+ * @fn void bucket_take(token_bucket *bucket, rate_limit *limit)
+ * @brief Take a token from a bucket, after bucket_wait() has found one available.
+ * @param bucket The token bucket.
+ * @param limit The rate and burst of the bucket.
  */
-void thread_cleanup(thread_parcel *parcel) {
-    if (parcel->return_value != 0)
-        print_log(1, "cleanup", "Worker thread returned an error.");
-    free(parcel);
-    print_log(0, "cleanup", "Worker thread cleaned up.");
+void bucket_take(token_bucket *bucket, rate_limit *limit) {
+    if (limit->rate > 0)
+        bucket->tokens -= 1;
 }
 
-/*****************************
- *       Thread def'ns       *
- *****************************/
+/**
+ * @fn token_bucket *path_bucket(char *path)
+ * @brief Find or create the token bucket of a file path.
+ *        Only the master thread may call this, or the limiter thread while holding limit_lock.
+ * @param path The file path.
+ * @return The path's token bucket.
+ */
+token_bucket *path_bucket(char *path) {
+    path_limiter **head = &path_limiters[hash_path(path) % PATH_BUCKETS], *curr;
+
+    for (curr = *head; curr != NULL; curr = curr->next)
+        if (strcmp(curr->path, path) == 0)
+            return &curr->bucket;
+
+    curr = calloc(1, sizeof(path_limiter));
+    curr->path = strdup(path);
+    curr->bucket.tokens = path_limit.burst;
+    clock_gettime(CLOCK_MONOTONIC, &curr->bucket.last);
+    curr->next = *head;
+    *head = curr;
+    return &curr->bucket;
+}
 
 /**
- * @fn void *worker_thread(void *arg)
- * @brief Worker thread that handles a single user request.
- *        This thread will receive a request from the master thread,
- *        parse the request, and handle the request accordingly.
- * @param arg thread_parcel of the thread
- * @return 0 on success, -1 on failure (check (thread_parcel *)arg->return_value).
+ * @fn double limit_wait(thread_parcel *parcel, token_bucket **by_client, token_bucket **by_path)
+ * @brief Find the token buckets of a request, and determine how long it takes
+ *        until both hold a token. parcel->client must be set if there is a client limit.
+ * @param parcel thread_parcel of the request.
+ * @param by_client Set to the client's bucket, or NULL if there is no client limit.
+ * @param by_path Set to the file's bucket, or NULL if there is no path limit.
+ * @return The number of seconds until both buckets hold a token, 0 if they do now.
  */
-void *worker_thread(void *arg) {
-    thread_parcel *parcel = (thread_parcel *)arg;
-    char *cmdline, *cmd, *file_path, text[51];
-    int request_type, preceding_len, text_len;
-    int wait_s, wait_prob = rand() % 100;
+double limit_wait(thread_parcel *parcel, token_bucket **by_client, token_bucket **by_path) {
+    char path[109];
+    double wait_s, path_wait_s;
 
-    // Get cmdline from parcel
-    cmdline = malloc(strlen(parcel->cmdline) + 1);
-    strcpy(cmdline, parcel->cmdline);
+    *by_client = client_limit.rate > 0 ? &parcel->client->bucket : NULL;
+    *by_path = path_limit.rate > 0 && request_path(parcel->cmdline, path) ? path_bucket(path) : NULL;
+    wait_s = *by_client != NULL ? bucket_wait(*by_client, &client_limit) : 0;
+    path_wait_s = *by_path != NULL ? bucket_wait(*by_path, &path_limit) : 0;
+    return path_wait_s > wait_s ? path_wait_s : wait_s;
+}
 
-    // All valid command lines contain the command name as the first arg
-    // and a file path as the second argument.
-    // Extract them from the command line.
-    cmd = strtok(cmdline, " ");
-    file_path = strtok(NULL, " ");
-    if (file_path == NULL) {
-        print_log(1, "worker", "Missing argument.");
-        parcel->return_value = -1;
-        thread_cleanup(parcel);
-        return NULL;
+/**
+ * @fn int admit_request(thread_parcel *parcel, char *client)
+ * @brief Enforce the per-client (-c) and per-path (-p) rate limits on a request,
+ *        before it is given a thread or a ticket. When over either limit, the request
+ *        is deferred until both buckets hold a token (see limiter_thread()), or rejected
+ *        with -l reject. Without defer_limited, the master thread waits instead.
+ *        Only the master thread may call this, holding limit_lock with defer_limited.
+ * @param parcel thread_parcel of the request.
+ * @param client The client prefix of the request, as returned by parse_client().
+ * @return 0 if the request may proceed, 1 if it was deferred, -1 if it was rejected.
+ */
+int admit_request(thread_parcel *parcel, char *client) {
+    token_bucket *by_client, *by_path;
+    double wait_s;
+
+    if (client_limit.rate <= 0 && path_limit.rate <= 0)
+        return 0;
+
+    pthread_mutex_lock(&dispatch_lock);
+    parcel->client = find_client(client);
+    pthread_mutex_unlock(&dispatch_lock);
+
+    while (1) {
+        wait_s = limit_wait(parcel, &by_client, &by_path);
+        if (wait_s == 0 && (by_client == NULL || by_client->deferred == 0) && (by_path == NULL || by_path->deferred == 0))
+            break;
+
+        if (limit_reject) {
+            print_log(1, "master", "Rate limit exceeded, rejecting request #%lu.", parcel->seq);
+            stat_limit_rejected++;
+            return -1;
+        }
+
+        // Leave the request to the limiter thread, behind any deferred for its client or file
+        stat_limit_delayed++;
+        if (defer_limited) {
+            print_log(0, "master", "Rate limit exceeded, deferring request #%lu.", parcel->seq);
+            if (by_client != NULL)
+                by_client->deferred++;
+            if (by_path != NULL)
+                by_path->deferred++;
+            track_request(parcel);
+            clock_gettime(CLOCK_MONOTONIC, &parcel->queued_at);
+            parcel->next = NULL;
+            if (deferred_tail != NULL)
+                deferred_tail->next = parcel;
+            else
+                deferred_head = parcel;
+            deferred_tail = parcel;
+            pthread_cond_signal(&limit_ready);
+            return 1;
+        }
+        print_log(0, "master", "Rate limit exceeded, delaying request #%lu by %.3f s.", parcel->seq, wait_s);
+        stat_limit_delay += wait_s;
+        usleep(wait_s * 1000000 + 1);
     }
 
-    // Check what type of request the client sent.
-    request_type = determine_request(cmd);
-    if (request_type == REQUEST_INVALID) {
-        print_log(1, "worker", "Invalid command.");
-        parcel->return_value = -1;
-        thread_cleanup(parcel);
-        return NULL;
+    if (by_client != NULL)
+        bucket_take(by_client, &client_limit);
+    if (by_path != NULL)
+        bucket_take(by_path, &path_limit);
+    return 0;
+}
+
+/**
+ * @fn void start_request(thread_parcel *parcel, char *client, int join)
+ * @brief Hand an admitted request over to whoever handles it in the current mode:
+ *        the master thread itself in reactor mode, the shard that owns its file,
+ *        the executors in memory-budgeted mode, the worker pool, or a new thread.
+ *        With defer_limited, the caller must hold limit_lock, so that requests started
+ *        by the master and limiter threads reach their files in the order they were admitted.
+ * @param parcel thread_parcel of the request.
+ * @param client The client prefix of the request, or NULL if parcel->client is set.
+ * @param join Whether to wait for the request's thread to finish (see -j).
+ */
+void start_request(thread_parcel *parcel, char *client, int join) {
+    pthread_t thread;
+
+    // In reactor mode, run the request to completion before reading the next one.
+    // Requests are then handled in FIFO order without any thread handoffs.
+    if (run_inline) {
+        print_log(0, "master", "Handling request inline.");
+        worker_thread(parcel);
+        return;
     }
 
-    // Optionally, the command line may contain free text as the third argument.
-    // Check if this argument is present using strlen and extract it.
-    preceding_len = strlen(cmd) + strlen(file_path) + 2;
-    if (strlen(parcel->cmdline) > preceding_len) {
-        // Make sure we're writing to a file.
-        if (request_type != REQUEST_WRITE) {
-            print_log(1, "worker", "Free text argument only valid for write requests.");
+    // From here on, the request can be cancelled until it gets its file's lock.
+    // Deferred requests could be cancelled already.
+    if (!parcel->tracked)
+        track_request(parcel);
+
+    // In shard mode, forward the request to the shard that owns its file, or the shards
+    // that own the files of a multi-file read. Invalid requests are turned away here.
+    if (shards != NULL) {
+        if (parse_request(parcel) != 0) {
             parcel->return_value = -1;
             thread_cleanup(parcel);
-            return NULL;
+        } else {
+            shard_fanout(parcel);
         }
+        return;
+    }
 
-        // How long is the free text?
-        text_len = strlen(parcel->cmdline) - preceding_len;
-        if (text_len > 50) {
-            print_log(1, "worker", "Free text argument is longer than 50 characters.");
+    // In memory-budgeted mode, park the request without a thread.
+    if (memory_mode) {
+        if (parse_request(parcel) != 0) {
             parcel->return_value = -1;
             thread_cleanup(parcel);
-            return NULL;
+        } else {
+            park_request(parcel);
         }
-
-        // Extract the free text using strncpy.
-        strncpy(text, parcel->cmdline + preceding_len, text_len);
-        text[text_len] = '\0';
+        return;
     }
 
-    // Initialize mutex and add this thread to the file queue.
-    print_log(0, "worker", "Attempting to acquire lock for file \"%s\".", file_path);
-    enqueue(file_path);
-    print_log(0, "worker", "Acquired lock for file \"%s\", now performing operation \"%s\".", file_path, cmd);
+    // With a worker pool, queue the request for the next free pool thread.
+    // Invalid requests are turned away here, since they have no file to queue for.
+    if (pool_running) {
+        if (parse_request(parcel) != 0) {
+            parcel->return_value = -1;
+            thread_cleanup(parcel);
+        } else {
+            dispatch_push(parcel, client);
+        }
+        return;
+    }
 
-    // Project requirement: sleep for 1 second 80% of the time, and 6 seconds 20% of the time
-    if (skip_sleep == 0) {
-        if (wait_prob < 80)
-            wait_s = 1;
+    print_log(0, "master", "Spawning new thread to handle request.");
+    if (pthread_create(&thread, NULL, worker_thread, parcel) != 0)
+        print_log(1, "master", "Could not create worker thread.");
+    else {
+        if (join == 1)
+            pthread_join(thread, NULL);
         else
-            wait_s = 6;
-        print_log(0, "worker", "Sleeping for %d sec...", wait_s);
-        sleep(wait_s);
+            pthread_detach(thread);
     }
+}
 
-    // Handle the request once the lock is free.
-    switch (request_type) {
-        case REQUEST_READ:
-            parcel->return_value = read_file(file_path, READ_FILE, parcel->cmdline, 0);
-            break;
-        case REQUEST_WRITE:
-            parcel->return_value = write_file(file_path, text, 1);
-            break;
-        case REQUEST_EMPTY:
-            // To avoid deadlocks, we can first read the file contents
-            // before emptying it, instead of having empty_file call
-            // read_file from within the same thread.
-            parcel->return_value = read_file(file_path, EMPTY_FILE, parcel->cmdline, 1);
-            if (parcel->return_value == 0)
-                parcel->return_value = empty_file(file_path, parcel->cmdline);
-            break;
-        default:
-            print_log(1, "worker", "Invalid request type.");
-            parcel->return_value = -1;
+/**
+ * @fn void *limiter_thread(void *arg)
+ * @brief Limiter thread that starts deferred requests once their token buckets refill,
+ *        in the order they were received, and sleeps until the next refill in between.
+ *        A deferred request stays behind any earlier one for its client or file that
+ *        cannot start yet. Cancelled requests start without a token, to report their status.
+ *        Runs until the master thread is done and no request is deferred anymore.
+ * @param arg Unused.
+ */
+void *limiter_thread(void *arg) {
+    thread_parcel *curr, *prev, *next;
+    token_bucket *by_client, *by_path;
+    struct timespec wake;
+    double wait_s, next_s;
+    unsigned long scan = 0;
+    int cancelled;
+
+    pthread_mutex_lock(&limit_lock);
+    while (deferred_head != NULL || !limit_closed) {
+        next_s = 0;
+        scan++;
+        for (prev = NULL, curr = deferred_head; curr != NULL; curr = next) {
+            next = curr->next;
+            wait_s = limit_wait(curr, &by_client, &by_path);
+            cancelled = __atomic_load_n(&curr->cancelled, __ATOMIC_SEQ_CST);
+            if (!cancelled &&
+                (wait_s > 0 || (by_client != NULL && by_client->held == scan) || (by_path != NULL && by_path->held == scan))) {
+                if (by_client != NULL)
+                    by_client->held = scan;
+                if (by_path != NULL)
+                    by_path->held = scan;
+                if (wait_s > 0 && (next_s == 0 || wait_s < next_s))
+                    next_s = wait_s;
+                prev = curr;
+                continue;
+            }
+
+            // Unlink the request and start it
+            if (prev != NULL)
+                prev->next = next;
+            else
+                deferred_head = next;
+            if (deferred_tail == curr)
+                deferred_tail = prev;
+            if (by_client != NULL) {
+                by_client->deferred--;
+                if (!cancelled)
+                    bucket_take(by_client, &client_limit);
+            }
+            if (by_path != NULL) {
+                by_path->deferred--;
+                if (!cancelled)
+                    bucket_take(by_path, &path_limit);
+            }
+            stat_limit_delay += elapsed_since(&curr->queued_at);
+            print_log(0, "limiter", "Starting deferred request #%lu.", curr->seq);
+            start_request(curr, NULL, 0);
+        }
+
+        if (deferred_head == NULL) {
+            pthread_cond_wait(&limit_ready, &limit_lock);
+        } else {
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_sec += (time_t)next_s;
+            wake.tv_nsec += (long)((next_s - (time_t)next_s) * 1e9) + 1000;
+            if (wake.tv_nsec >= 1000000000) {
+                wake.tv_sec++;
+                wake.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&limit_ready, &limit_lock, &wake);
+        }
     }
+    pthread_mutex_unlock(&limit_lock);
+    return NULL;
+}
 
-    // Dequeue the file and destroy the lock.
-    print_log(0, "worker", "Releasing lock for file \"%s\"", file_path);
-    dequeue(file_path);
+/**
+ * @fn void replay_request(char *cmdline, unsigned long seq, char *status)
+ * @brief Redo a request from the journal, to completion and without the
+ *        spec-mandated sleeps. Deadlines and rate limits do not apply.
+ *        A request that was turned away is reported with the same status instead.
+ * @param cmdline The command line, as received.
+ * @param seq The number of the request.
+ * @param status The status the request was turned away with, or NULL to redo it.
+ */
+void replay_request(char *cmdline, unsigned long seq, char *status) {
+    char client[109], *command;
+    thread_parcel *parcel;
 
-    // Deallocate the command line copy and the thread parcel.
-    free(cmdline);
+    command = parse_client(cmdline, client);
+    parcel = calloc(1, sizeof(thread_parcel));
+    command = parse_deadline(command, &parcel->deadline);
+    if (strncmp(command, "cancel ", 7) == 0) {
+        free(parcel);
+        return;
+    }
+    strcpy(parcel->cmdline, command);
+    parcel->seq = seq;
+    parcel->deadline.tv_sec = 0;
+    print_log(0, "recovery", "Replaying request #%lu: %s", seq, cmdline);
+    if (parse_request(parcel) != 0)
+        parcel->return_value = -1;
+    else if (status != NULL)
+        parcel->return_value = report_status(parcel, status);
+    else
+        handle_request(parcel);
+    __sync_fetch_and_add(&stat_replayed, 1);
     thread_cleanup(parcel);
 }
 
+/**
+ * @fn int recover_journal()
+ * @brief Bring user files, <READ_FILE> and <EMPTY_FILE> back to a consistent state after
+ *        a crash (see -k). Files are restored as of the last checkpoint, and the requests
+ *        received after it, or still pending at the time, are replayed from <COMMANDS_FILE>
+ *        in order; those that were turned away with a status are reported with it again
+ *        (see save_outcome()). Only the end of the journal is read, from the oldest such
+ *        request on.
+ *        A new checkpoint is written once done. Without a checkpoint, there is nothing to
+ *        recover, and the journal is only read to number the requests that follow.
+ * @return 0 on success, -1 on failure.
+ */
+int recover_journal() {
+    FILE *manifest, *journal, *list;
+    file_t *file;
+    char line[256], path[109], *cmdline, *journal_path, (*statuses)[32] = NULL, *status;
+    unsigned long gen, last_seq, seq, applied_seq, *pending = NULL, *outcomes = NULL;
+    unsigned long read_segment, empty_segment, journal_segment = outputs[2].active;
+    long long offset;
+    size_t read_size, empty_size;
+    int pending_count = 0, next_pending = 0, skip_sleep_was = skip_sleep, recovering;
+    int outcome_count = 0, outcome;
+
+    if (mkdir(UNDO_DIR, 0777) != 0 && errno != EEXIST) {
+        print_log(1, "recovery", "Cannot create \"%s\": %s", UNDO_DIR, strerror(errno));
+        return -1;
+    }
+
+    manifest = fopen(CHECKPOINT_FILE, "r");
+    recovering = manifest != NULL;
+    if (!recovering) {
+        // Number requests on from the last sealed journal segment, if any
+        last_seq = 0;
+        offset = 0;
+        seq = outputs[2].sealed_count > 0 ? outputs[2].sealed[outputs[2].sealed_count - 1].last_seq + 1 : 1;
+    } else {
+        // Checkpoints from before segment rotation have no segment numbers
+        read_segment = outputs[0].active;
+        empty_segment = outputs[1].active;
+        if (fgets(line, sizeof(line), manifest) == NULL ||
+            sscanf(line, "checkpoint %lu %lu %lld %lu %zu %zu %lu %lu %lu", &gen, &last_seq, &offset, &seq,
+                   &read_size, &empty_size, &read_segment, &empty_segment, &journal_segment) < 6) {
+            print_log(1, "recovery", "\"%s\" is damaged.", CHECKPOINT_FILE);
+            fclose(manifest);
+            return -1;
+        }
+        while (fgets(line, sizeof(line), manifest) != NULL) {
+            if (sscanf(line, "pending %lu", &applied_seq) == 1) {
+                pending = realloc(pending, (pending_count + 1) * sizeof(unsigned long));
+                pending[pending_count++] = applied_seq;
+            } else if (sscanf(line, "applied %lu %108s", &applied_seq, path) == 2) {
+                ticket_lock("open_files", open_files_lock);
+                file = find_file(path);
+                file->applied_seq = applied_seq;
+                ticket_unlock(open_files_lock);
+            }
+        }
+        fclose(manifest);
+
+        // Requests turned away since the checkpoint are reported again, not redone
+        list = fopen(UNDO_DIR "/outcomes", "r");
+        while (list != NULL && fscanf(list, "%lu %31[^\n]", &applied_seq, path) == 2) {
+            outcomes = realloc(outcomes, (outcome_count + 1) * sizeof(unsigned long));
+            statuses = realloc(statuses, (outcome_count + 1) * sizeof(*statuses));
+            outcomes[outcome_count] = applied_seq;
+            strcpy(statuses[outcome_count++], path);
+        }
+        if (list != NULL)
+            fclose(list);
+
+        // Undo whatever happened after the checkpoint. The output files only ever grow.
+        checkpoint_gen = gen;
+        restore_undo(gen);
+        clear_undo();
+        output_rewind(&outputs[0], read_segment, read_size);
+        output_rewind(&outputs[1], empty_segment, empty_size);
+    }
+
+    // Replay the end of the journal, which may go on into segments sealed after the
+    // checkpoint. A line cut short by a crash was never dispatched.
+    journal_path = segment_path(&outputs[2], journal_segment);
+    journal = fopen(journal_path, "r");
+    skip_sleep = 1;
+    if (journal != NULL && fseeko(journal, offset, SEEK_SET) == 0) {
+        while (1) {
+            if (fgets(line, sizeof(line), journal) == NULL) {
+                if (journal_segment >= outputs[2].active)
+                    break;
+                fclose(journal);
+                free(journal_path);
+                journal_path = segment_path(&outputs[2], ++journal_segment);
+                offset = 0;
+                if ((journal = fopen(journal_path, "r")) == NULL)
+                    break;
+                continue;
+            }
+            if (line[strlen(line) - 1] != '\n') {
+                print_log(1, "recovery", "Dropping a torn line at the end of \"%s\".", COMMANDS_FILE);
+                if (truncate(journal_path, offset) != 0)
+                    print_log(1, "recovery", "Cannot truncate \"%s\": %s", COMMANDS_FILE, strerror(errno));
+                break;
+            }
+            offset += strlen(line);
+            line[strlen(line) - 1] = '\0';
+            while (next_pending < pending_count && pending[next_pending] < seq)
+                next_pending++;
+            cmdline = strstr(line, "] ");
+            if (recovering && cmdline != NULL &&
+                (seq > last_seq || (next_pending < pending_count && pending[next_pending] == seq))) {
+                status = NULL;
+                for (outcome = 0; outcome < outcome_count; outcome++)
+                    if (outcomes[outcome] == seq)
+                        status = statuses[outcome];
+                replay_request(cmdline + 2, seq, status);
+            }
+            seq++;
+        }
+    }
+    if (journal != NULL)
+        fclose(journal);
+    free(journal_path);
+    skip_sleep = skip_sleep_was;
+    free(pending);
+    free(outcomes);
+    free(statuses);
+
+    journal_seq = seq - 1;
+    journal_size = offset;
+    if (stat_replayed > 0)
+        print_log(1, "recovery", "Replayed %lu requests.", stat_replayed);
+    return write_checkpoint();
+}
+
 /**
  * @fn void *master_thread(void* arg)
  * @brief Master thread that handles all user requests.
@@ -587,15 +6619,18 @@ void *worker_thread(void *arg) {
  *        appending each command to a file named <COMMANDS_FILE> along with
  *        the timestamp of the command.
  * @param arg Set to 1 to join spawned worker threads and 0 to detach them.
+ *            Ignored in reactor (-r), shard (-s) and worker pool (-w) modes,
+ *            where no worker threads are spawned per request.
  */
 void *master_thread(void *arg) {
     // The longest command name is 5 characters,
     // and the file path and text are both at most 50 characters,
     // therefore including whitespace each command line is at most 107 characters.
     // This leaves us with a total of 109, including the newline and a NULL terminator.
-    char *timestamp, *log_line, cmdline[109];
+    char *command, cmdline[109], client[109];
     thread_parcel *parcel;
-    pthread_t thread;
+    unsigned long seq = journal_seq;
+    int admitted;
 
     // Loop forever
     while (1) {
@@ -611,29 +6646,57 @@ void *master_thread(void *arg) {
         cmdline[strcspn(cmdline, "\n")] = '\0';
         if (strlen(cmdline) == 0)
             continue;
-        print_log(0, "master", "Received command: %s", cmdline);
-
-        // Create log line with timestamp
-        timestamp = get_time();
-        log_line = malloc(strlen(timestamp) + strlen(cmdline) + 4);
-        sprintf(log_line, "[%s] %s\n", timestamp, cmdline);
-        write_file(COMMANDS_FILE, log_line, 0);
-        free(log_line);
+        print_log(0, "master", "Received command #%lu: %s", ++seq, cmdline);
 
         // Create a new thread to handle the request
-        parcel = malloc(sizeof(thread_parcel));
-        strcpy(parcel->cmdline, cmdline);
+        command = parse_client(cmdline, client);
+        parcel = calloc(1, sizeof(thread_parcel));
+        command = parse_deadline(command, &parcel->deadline);
+        strcpy(parcel->cmdline, command);
         parcel->return_value = 0;
-        print_log(0, "master", "Spawning new thread to handle request.");
-        if (pthread_create(&thread, NULL, worker_thread, parcel) != 0)
-            print_log(1, "master", "Could not create worker thread.");
-        else {
-            if (*(int*)arg == 1)
-                pthread_join(thread, NULL);
-            else
-                pthread_detach(thread);
+        parcel->seq = seq;
+
+        // Log the command line with a timestamp
+        journal_request(parcel, cmdline);
+
+        // Cancellations are handled right here, and never reach a worker.
+        if (strncmp(command, "cancel ", 7) == 0) {
+            cancel_request(strtoul(command + 7, NULL, 10));
+            free(parcel);
+            continue;
+        }
+
+        // Requests over their client's or file's rate limit are deferred,
+        // or turned away without ever reaching a worker.
+        if (defer_limited)
+            pthread_mutex_lock(&limit_lock);
+        admitted = admit_request(parcel, client);
+        if (admitted != 0) {
+            if (admitted < 0 && parse_request(parcel) == 0)
+                parcel->return_value = report_status(parcel, "RATE LIMITED");
+            else if (admitted < 0)
+                parcel->return_value = -1;
+            if (admitted < 0)
+                thread_cleanup(parcel);
+            if (defer_limited)
+                pthread_mutex_unlock(&limit_lock);
+            continue;
         }
+
+        // Hand the request over to whoever handles it in the current mode
+        start_request(parcel, client, *(int*)arg);
+        if (defer_limited)
+            pthread_mutex_unlock(&limit_lock);
+    }
+
+    // Let the limiter thread finish once nothing is deferred anymore
+    if (defer_limited) {
+        pthread_mutex_lock(&limit_lock);
+        limit_closed = 1;
+        pthread_cond_signal(&limit_ready);
+        pthread_mutex_unlock(&limit_lock);
     }
+    return NULL;
 }
 
 /**
@@ -646,9 +6709,16 @@ void *master_thread(void *arg) {
  * @return 0 on success, 1 on failure.
  */
 int main(int argc, char *argv[]) {
-    pthread_t master;
+    pthread_t master, limit_thread, scaler, timer, checkpointer, syncer, flusher, *executors = NULL;
+    pthread_attr_t executor_attr;
+    pthread_condattr_t timer_attr;
     file_t *curr, *next;
-    int arg, join_threads = 0;
+    client_t *client, *next_client;
+    path_limiter *limiter, *next_limiter;
+    int arg, shard, bucket, executor, join_threads = 0;
+    unsigned long lookup_seq = 0;
+    char *record;
+    size_t record_len;
 
     // Check if the user wants to join threads
     for (arg = 1; arg < argc; arg++) {
@@ -658,19 +6728,161 @@ int main(int argc, char *argv[]) {
             join_threads = 1;
         else if (strcmp(argv[arg], "-v") == 0 && log_to_console == 0)
             log_to_console = 1;
+        else if (strcmp(argv[arg], "-r") == 0 && run_inline == 0)
+            run_inline = 1;
+        else if (strcmp(argv[arg], "-s") == 0 && shard_count == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+            shard_count = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "-a") == 0 && placement == PLACEMENT_NONE && arg + 1 < argc && strcmp(argv[arg + 1], "core") == 0)
+            placement = PLACEMENT_CORE, arg++;
+        else if (strcmp(argv[arg], "-a") == 0 && placement == PLACEMENT_NONE && arg + 1 < argc && strcmp(argv[arg + 1], "node") == 0)
+            placement = PLACEMENT_NODE, arg++;
+        else if (strcmp(argv[arg], "-t") == 0 && print_stats == 0)
+            print_stats = 1;
+        else if (strcmp(argv[arg], "-m") == 0 && memory_mode == 0)
+            memory_mode = 1;
+        else if (strcmp(argv[arg], "-e") == 0 && archive_dir == NULL && arg + 1 < argc)
+            archive_dir = argv[++arg];
+        else if (strcmp(argv[arg], "-k") == 0 && checkpoint_every == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+            checkpoint_every = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "-d") == 0 && durability == DURABILITY_NONE && arg + 1 < argc && strcmp(argv[arg + 1], "none") == 0)
+            arg++;
+        else if (strcmp(argv[arg], "-d") == 0 && durability == DURABILITY_NONE && arg + 1 < argc && strcmp(argv[arg + 1], "close") == 0)
+            durability = DURABILITY_CLOSE, arg++;
+        else if (strcmp(argv[arg], "-d") == 0 && durability == DURABILITY_NONE && arg + 1 < argc && strcmp(argv[arg + 1], "group") == 0)
+            durability = DURABILITY_GROUP, arg++;
+        else if (strcmp(argv[arg], "-f") == 0 && writeback_limit == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+            writeback_limit = (size_t)atoi(argv[++arg]) * 1024;
+        else if (strcmp(argv[arg], "-o") == 0 && rotate_size == 0 && rotate_age == 0 && arg + 1 < argc &&
+                 sscanf(argv[arg + 1], "%zu:%ld:%d", &rotate_size, &rotate_age, &rotate_keep) >= 1 &&
+                 (rotate_size > 0 || rotate_age > 0) && rotate_age >= 0 && rotate_keep >= 0)
+            rotate_size *= 1024 * 1024, arg++;
+        else if (strcmp(argv[arg], "-x") == 0 && response_index == 0)
+            response_index = 1;
+        else if (strcmp(argv[arg], "-g") == 0 && lookup_seq == 0 && arg + 1 < argc && strtoul(argv[arg + 1], NULL, 10) > 0)
+            lookup_seq = strtoul(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-b") == 0 && storage == NULL && arg + 1 < argc && (storage = find_engine(argv[arg + 1])) != NULL)
+            arg++;
+        else if (strcmp(argv[arg], "-w") == 0 && pool_size == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+            pool_size = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "-W") == 0 && pool_max == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+            pool_max = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "-q") == 0 && queue_policy == POLICY_FIFO && arg + 1 < argc && strcmp(argv[arg + 1], "fifo") == 0)
+            arg++;
+        else if (strcmp(argv[arg], "-q") == 0 && queue_policy == POLICY_FIFO && arg + 1 < argc && strcmp(argv[arg + 1], "fair") == 0)
+            queue_policy = POLICY_FAIR, arg++;
+        else if (strcmp(argv[arg], "-q") == 0 && queue_policy == POLICY_FIFO && arg + 1 < argc && strcmp(argv[arg + 1], "read") == 0)
+            queue_policy = POLICY_READ, arg++;
+        else if (strcmp(argv[arg], "-q") == 0 && queue_policy == POLICY_FIFO && arg + 1 < argc && strcmp(argv[arg + 1], "edf") == 0)
+            queue_policy = POLICY_EDF, arg++;
+        else if (strcmp(argv[arg], "-c") == 0 && client_limit.rate == 0 && arg + 1 < argc &&
+                 sscanf(argv[arg + 1], "%lf:%lf", &client_limit.rate, &client_limit.burst) == 2 && client_limit.rate > 0 && client_limit.burst >= 1)
+            arg++;
+        else if (strcmp(argv[arg], "-p") == 0 && path_limit.rate == 0 && arg + 1 < argc &&
+                 sscanf(argv[arg + 1], "%lf:%lf", &path_limit.rate, &path_limit.burst) == 2 && path_limit.rate > 0 && path_limit.burst >= 1)
+            arg++;
+        else if (strcmp(argv[arg], "-l") == 0 && limit_reject == 0 && arg + 1 < argc && strcmp(argv[arg + 1], "delay") == 0)
+            arg++;
+        else if (strcmp(argv[arg], "-l") == 0 && limit_reject == 0 && arg + 1 < argc && strcmp(argv[arg + 1], "reject") == 0)
+            limit_reject = 1, arg++;
         else {
             fprintf(stderr, "Invalid argument: %s\n\n", argv[arg]);
-            printf("Usage: %s [-i] [-j] [-v]\n", argv[0]);
+            printf("Usage: %s [-i] [-j] [-v] [-r] [-s shards] [-a core|node] [-t] [-w workers] [-W max_workers] [-q fifo|fair|read|edf]\n", argv[0]);
+            printf("\t[-c rate:burst] [-p rate:burst] [-l delay|reject] [-m] [-e archive_dir] [-b posix|memory|log] [-k requests]\n");
             printf("\t-i\tInstant mode: Skip spec-mandated sleeps. Off by default.\n");
             printf("\t-j\tJoin mode: Join worker threads after they have finished, making the server blocking.\n");
             printf("\t\tBy default, threads are detached, so the server can keep accepting input\n");
             printf("\t\twhile the worker threads are running. Off by default.\n");
             printf("\t-v\tVerbose mode: print logs to stdout. Off by default.\n");
+            printf("\t-r\tReactor mode: handle each request to completion on the master thread,\n");
+            printf("\t\tin FIFO order and without locking. Best combined with -i. Off by default.\n");
+            printf("\t-s n\tShard mode: split file paths by hash among n shard threads pinned to cores,\n");
+            printf("\t\teach handling its own requests to completion in FIFO order. Off by default.\n");
+            printf("\t-a p\tPlacement policy: run each worker thread on the core (p = core) or\n");
+            printf("\t\tNUMA node (p = node) that owns its file path. Off by default.\n");
+            printf("\t-t\tStatistics: print the server's counters to stderr on exit. Off by default.\n");
+            printf("\t-w n\tWorker pool: queue requests for a pool of n worker threads instead of\n");
+            printf("\t\tspawning a thread per request. Off by default.\n");
+            printf("\t-W n\tAutoscaling: let the worker pool grow up to n threads while requests\n");
+            printf("\t\tqueue up, and shrink back to the -w size (default 1) when idle.\n");
+            printf("\t-q p\tQueue policy for the worker pool: fifo (default), fair (weighted fair\n");
+            printf("\t\tqueuing across \"@client\" prefixes), read (fair, with reads first), or\n");
+            printf("\t\tedf (earliest \"+ms\" deadline first).\n");
+            printf("\t-c r:b\tRate limit each client to r requests per second, in bursts of up to b.\n");
+            printf("\t-p r:b\tRate limit each file path to r requests per second, in bursts of up to b.\n");
+            printf("\t-l a\tAction for requests over a rate limit: delay (default) or reject.\n");
+            printf("\t-m\tMemory-budgeted mode: waiting and sleeping requests hold no thread,\n");
+            printf("\t\tand are run by -w executor threads (default: one per CPU). Off by default.\n");
+            printf("\t-e d\tEmpty archive: empties move their file into directory d, and record\n");
+            printf("\t\twhere in empty.txt, instead of copying its contents. Off by default.\n");
+            printf("\t-b s\tStorage engine for user files: posix (default, one file per path), memory\n");
+            printf("\t\t(never written to disk), or log (records in append-only segments under\n");
+            printf("\t\t\"" LOG_DIR "\", with compaction).\n");
+            printf("\t-k n\tCrash recovery: checkpoint every n requests, and on startup replay the\n");
+            printf("\t\trequests in " COMMANDS_FILE " that the last checkpoint misses. Off by default.\n");
+            printf("\t-d l\tDurability: none (default, leave syncing to the OS), close (sync the files\n");
+            printf("\t\ta request changed before it completes), or group (the same, but sync the\n");
+            printf("\t\tfiles of all requests completing within %d us at once).\n", GROUP_COMMIT_US);
+            printf("\t-f n\tWrite-back buffering: keep appends to user files in memory for up to\n");
+            printf("\t\t%d ms, with at most n KB buffered in total. Off by default.\n", WRITEBACK_INTERVAL_US / 1000);
+            printf("\t-o m:s:k\tSegment rotation: seal the active segment of read.txt, empty.txt and\n");
+            printf("\t\tcommands.txt once it holds m MB or is s seconds old (0 for no limit), and\n");
+            printf("\t\tkeep the last k sealed segments (0 to keep all). Off by default.\n");
+            printf("\t-x\tResponse index: index the record of each request in read.txt and empty.txt\n");
+            printf("\t\tby request number, in read.txt.idx and empty.txt.idx. Off by default.\n");
+            printf("\t-g n\tLook up the record of request n with the response index, print it, and exit.\n");
             return 1;
         }
     }
+    // Look up a record and exit, without starting the server
+    if (lookup_seq > 0) {
+        record = lookup_response(READ_FILE, lookup_seq, &record_len);
+        if (record == NULL)
+            record = lookup_response(EMPTY_FILE, lookup_seq, &record_len);
+        if (record == NULL) {
+            fprintf(stderr, "No record of request #%lu.\n", lookup_seq);
+            return 1;
+        }
+        fwrite(record, 1, record_len, stdout);
+        free(record);
+        return 0;
+    }
+
+    if (pool_max && !pool_size)
+        pool_size = 1;
+    if (pool_max < pool_size)
+        pool_max = pool_size;
     if (skip_sleep) print_log(0, "main", "Instant mode enabled.");
     if (join_threads) print_log(0, "main", "Join mode enabled.");
+    if (run_inline) print_log(0, "main", "Reactor mode enabled.");
+    if (shard_count && !run_inline) print_log(0, "main", "Shard mode enabled with %d shards.", shard_count);
+    if (placement == PLACEMENT_CORE) print_log(0, "main", "Placing workers on their file's core.");
+    if (placement == PLACEMENT_NODE) print_log(0, "main", "Placing workers on their file's NUMA node.");
+    if (memory_mode && (run_inline || shard_count))
+        memory_mode = 0;
+
+    // Replay assumes the requests for a file ran in the order they were received,
+    // which thread-per-request mode and the non-FIFO queue policies do not keep.
+    // Crash recovery then runs requests in memory-budgeted mode, or queues them FIFO.
+    if (checkpoint_every && !run_inline && !shard_count && !memory_mode && pool_size == 0 && !join_threads) {
+        print_log(1, "main", "Crash recovery needs requests for a file to run in order, using memory-budgeted mode.");
+        memory_mode = 1;
+    }
+    if (checkpoint_every && !run_inline && !shard_count && !memory_mode && queue_policy != POLICY_FIFO) {
+        print_log(1, "main", "Crash recovery needs requests for a file to run in order, using the fifo queue policy.");
+        queue_policy = POLICY_FIFO;
+    }
+    if (memory_mode) print_log(0, "main", "Memory-budgeted mode enabled.");
+    if (archive_dir) print_log(0, "main", "Archiving emptied files into \"%s\".", archive_dir);
+    if (storage == NULL)
+        storage = &posix_engine;
+    print_log(0, "main", "Keeping user files in the %s storage engine.", storage->name);
+    if (checkpoint_every) print_log(0, "main", "Crash recovery enabled, with a checkpoint every %d requests.", checkpoint_every);
+    if (durability == DURABILITY_CLOSE) print_log(0, "main", "Syncing changed files as each request completes.");
+    if (durability == DURABILITY_GROUP) print_log(0, "main", "Syncing changed files in group commits.");
+    if (writeback_limit) print_log(0, "main", "Write-back buffering enabled, with up to %zu KB dirty.", writeback_limit / 1024);
+    if (response_index) print_log(0, "main", "Response index enabled.");
+    if (rotate_size || rotate_age) print_log(0, "main", "Segment rotation enabled, at %zu MB or %ld s.", rotate_size / (1024 * 1024), rotate_age);
+    if (pool_size && !run_inline && !shard_count && !memory_mode) print_log(0, "main", "Worker pool enabled with %d to %d workers.", pool_size, pool_max);
     if (log_to_console) {
         print_log(0, "main", "Verbose mode enabled.");
         setvbuf(stdout, NULL, _IONBF, 0);
@@ -683,29 +6895,205 @@ int main(int argc, char *argv[]) {
     // Seed RNG
     srand(time(0));
 
+    // Create the empty archive, if it does not exist yet
+    archive_run = time(NULL);
+    if (archive_dir != NULL && mkdir(archive_dir, 0777) != 0 && errno != EEXIST) {
+        print_log(1, "main", "Cannot create empty archive \"%s\": %s", archive_dir, strerror(errno));
+        return 1;
+    }
+
+    // Discover CPUs and NUMA nodes for shard and worker placement
+    topology_init();
+
+    // Catch SIGBUS from sources truncated while mapped (see mmap_copy())
+    signal(SIGBUS, mmap_fault);
+
+    // Find the segments of the server's own files
+    output_init();
+
+    // Open the storage engine
+    if (storage->open != NULL && storage->open() != 0)
+        return 1;
+
+    // Start the sync thread of group commit mode, and the flusher of write-back buffering
+    if (durability == DURABILITY_GROUP)
+        pthread_create(&syncer, NULL, sync_thread, NULL);
+    if (writeback_limit)
+        pthread_create(&flusher, NULL, writeback_thread, NULL);
+
+    // Recover from a crash, then keep writing checkpoints
+    if (checkpoint_every) {
+        if (recover_journal() != 0)
+            return 1;
+        pthread_create(&checkpointer, NULL, checkpoint_thread, NULL);
+    }
+
+    // Start the timer and executor threads of memory-budgeted mode
+    if (memory_mode) {
+        pthread_condattr_init(&timer_attr);
+        pthread_condattr_setclock(&timer_attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&timer_ready, &timer_attr);
+        pthread_condattr_destroy(&timer_attr);
+        pthread_create(&timer, NULL, timer_thread, NULL);
+
+        if (pool_size == 0)
+            pool_size = cpu_count;
+        executors = calloc(pool_size, sizeof(pthread_t));
+        pthread_attr_init(&executor_attr);
+        pthread_attr_setstacksize(&executor_attr, EXEC_STACK_SIZE);
+        for (executor = 0; executor < pool_size; executor++)
+            pthread_create(&executors[executor], &executor_attr, executor_thread, NULL);
+        pthread_attr_destroy(&executor_attr);
+    }
+
+    // Start the worker pool. Reactor, shard and memory-budgeted modes take precedence.
+    if (pool_size && !run_inline && !shard_count && !memory_mode) {
+        pool_running = 1;
+        pthread_mutex_lock(&dispatch_lock);
+        pool_grow(pool_size);
+        pthread_mutex_unlock(&dispatch_lock);
+        if (pool_max > pool_size)
+            pthread_create(&scaler, NULL, scaler_thread, NULL);
+    }
+
+    // Start shard threads. Reactor mode takes precedence over shard mode.
+    if (shard_count && !run_inline) {
+        shards = calloc(shard_count, sizeof(shard_t));
+        for (shard = 0; shard < shard_count; shard++) {
+            shards[shard].id = shard;
+            sem_init(&shards[shard].slots, 0, SHARD_RING_SIZE);
+            sem_init(&shards[shard].items, 0, 0);
+            pthread_create(&shards[shard].thread, NULL, shard_thread, &shards[shard]);
+        }
+    }
+
+    // Start the limiter thread, unless requests are handled one at a time anyway
+    if ((client_limit.rate > 0 || path_limit.rate > 0) && !limit_reject && !run_inline && !join_threads) {
+        defer_limited = 1;
+        pthread_create(&limit_thread, NULL, limiter_thread, NULL);
+    }
+
     // Create master thread
     print_log(0, "main", "Starting file server...");
     pthread_create(&master, NULL, master_thread, (void*)&join_threads);
 
-    // Wait for master thread to finish
+    // Wait for master thread to finish, and for the deferred requests to be started
     pthread_join(master, NULL);
+    if (defer_limited)
+        pthread_join(limit_thread, NULL);
+
+    // Let requests in memory-budgeted mode finish, then stop the executors and timer
+    if (memory_mode) {
+        pthread_mutex_lock(&evented_lock);
+        while (evented_inflight > 0)
+            pthread_cond_wait(&evented_done, &evented_lock);
+        evented_closed = 1;
+        pthread_cond_broadcast(&evented_ready);
+        pthread_mutex_unlock(&evented_lock);
+        pthread_mutex_lock(&timer_lock);
+        pthread_cond_signal(&timer_ready);
+        pthread_mutex_unlock(&timer_lock);
+
+        for (executor = 0; executor < pool_size; executor++)
+            pthread_join(executors[executor], NULL);
+        pthread_join(timer, NULL);
+        pthread_cond_destroy(&timer_ready);
+        free(executors);
+        free(timer_heap);
+    }
+
+    // Let the worker pool drain the dispatch queue, then stop it
+    if (pool_running) {
+        pthread_mutex_lock(&dispatch_lock);
+        dispatch_closed = 1;
+        pthread_cond_broadcast(&dispatch_ready);
+        while (pool_live > 0)
+            pthread_cond_wait(&pool_exited, &dispatch_lock);
+        pthread_mutex_unlock(&dispatch_lock);
+        if (pool_max > pool_size)
+            pthread_join(scaler, NULL);
+    }
+    for (client = clients; client != NULL; client = next_client) {
+        next_client = client->next;
+        free(client);
+    }
+
+    // Destroy per-path rate limiters
+    for (bucket = 0; bucket < PATH_BUCKETS; bucket++) {
+        for (limiter = path_limiters[bucket]; limiter != NULL; limiter = next_limiter) {
+            next_limiter = limiter->next;
+            free(limiter->path);
+            free(limiter);
+        }
+    }
+
+    // Let shards drain their rings, then stop them
+    if (shards != NULL) {
+        for (shard = 0; shard < shard_count; shard++)
+            shard_push(&shards[shard], NULL);
+        for (shard = 0; shard < shard_count; shard++) {
+            pthread_join(shards[shard].thread, NULL);
+            sem_destroy(&shards[shard].slots);
+            sem_destroy(&shards[shard].items);
+        }
+        free(shards);
+    }
+
+    // Stop the flusher, once it has written out every buffer
+    if (writeback_limit) {
+        pthread_mutex_lock(&writeback_lock);
+        writeback_closed = 1;
+        pthread_cond_signal(&writeback_ready);
+        pthread_mutex_unlock(&writeback_lock);
+        pthread_join(flusher, NULL);
+    }
+
+    // Stop writing checkpoints, and write a last one
+    if (checkpoint_every) {
+        pthread_mutex_lock(&journal_lock);
+        checkpoint_closed = 1;
+        pthread_cond_signal(&checkpoint_ready);
+        pthread_mutex_unlock(&journal_lock);
+        pthread_join(checkpointer, NULL);
+        write_checkpoint();
+    }
+
+    // Stop the sync thread, once it has synced the last batch
+    if (durability == DURABILITY_GROUP) {
+        pthread_mutex_lock(&sync_lock);
+        sync_closed = 1;
+        pthread_cond_signal(&sync_ready);
+        pthread_mutex_unlock(&sync_lock);
+        pthread_join(syncer, NULL);
+    }
+
+    // Close the storage engine
+    if (storage->close != NULL)
+        storage->close();
 
     // Destroy ticketing lock on open_files
-    pthread_mutex_destroy(&open_files_lock->lock);
-    pthread_cond_destroy(&open_files_lock->queue);
+    ticket_destroy(open_files_lock);
     free(open_files_lock);
 
     // Destroy all open files
-    curr = open_files;
-    while (curr != NULL) {
-        next = curr->next;
-        pthread_mutex_destroy(&curr->lock->lock);
-        pthread_cond_destroy(&curr->lock->queue);
-        free(curr->lock);
-        free(curr);
-        curr = next;
+    for (bucket = 0; bucket < REGISTRY_BUCKETS; bucket++) {
+        curr = open_files[bucket];
+        while (curr != NULL) {
+            next = curr->next;
+            ticket_destroy(curr->lock);
+            free(curr->lock);
+            pthread_mutex_destroy(&curr->wb_lock);
+            free(curr->wb_data);
+            free(curr->path);
+            free(curr);
+            curr = next;
+        }
     }
 
+    // Report counters
+    if (print_stats)
+        report_stats();
+
     // Exit
     print_log(0, "main", "Exiting file server...");
     return 0;
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Stress test for memory-budgeted mode (-m).
+# Holds a burst of requests in flight at once, and reports the peak number of
+# requests in flight and the peak RSS of the server (see -t).
+#
+# The requests come in pairs on distinct files: an empty of an existing file,
+# which sleeps for 8 to 16 seconds as mandated by the project specification,
+# followed by a read of the same file, which is parked until the empty is done.
+# As long as the server takes less than 8 seconds to receive the whole burst,
+# every request is still in flight when the last one arrives.
+#
+# Usage: ./stress_memory.sh [requests] [extra server flags...]
+# The number of requests defaults to 100000. Runs in a temporary directory.
+
+requests=${1:-100000}
+[ $# -gt 0 ] && shift
+files=$((requests / 2))
+src=$(cd "$(dirname "$0")" && pwd)/file_server.c
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cd "$dir" || exit 1
+gcc -O2 -o file_server -pthread "$src" || exit 1
+
+# Baseline: the server's RSS with a single request
+echo "read baseline" | ./file_server -m -i -t "$@" >/dev/null 2>baseline.txt
+base_kb=$(sed -n 's/^memory: .*, \([0-9]*\) KB peak RSS$/\1/p' baseline.txt)
+rm -f commands.txt read.txt empty.txt
+
+mkdir files
+seq 1 $files | sed 's|^|files/|' | xargs touch
+seq 1 $files | sed 's|.*|empty files/&\nread files/&|' >burst.txt
+
+echo "Sending $((files * 2)) requests on $files files..."
+start=$(date +%s)
+./file_server -m -t "$@" <burst.txt >/dev/null 2>stats.txt
+end=$(date +%s)
+
+inflight=$(sed -n 's/^memory: \([0-9]*\) requests in flight at peak, .*$/\1/p' stats.txt)
+peak_kb=$(sed -n 's/^memory: .*, \([0-9]*\) KB peak RSS$/\1/p' stats.txt)
+echo "Finished in $((end - start)) s."
+echo "$inflight requests in flight at peak, $peak_kb KB peak RSS ($base_kb KB with a single request)."
+if [ "$inflight" -gt 0 ]; then
+    echo "About $(((peak_kb - base_kb) * 1024 / inflight)) bytes per request in flight."
+fi